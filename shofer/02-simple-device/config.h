@@ -20,9 +20,12 @@
 
 /* Circular buffer */
 struct buffer {
-	struct kfifo fifo;
+	struct kfifo fifo;	/* data is allocated separately (kvmalloc) */
 	struct mutex lock;	/* prevent parallel access */
-};
+
+	/* readers wait for data, writers for free space */
+	struct wait_queue_head rq, wq;
+} ____cacheline_aligned_in_smp;
 
 /* Device driver */
 struct shofer_dev {
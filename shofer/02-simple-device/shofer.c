@@ -17,12 +17,14 @@
 #include <linux/moduleparam.h>
 
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
+#include <linux/wait.h>
 
 #include "config.h"
 
@@ -40,6 +42,9 @@ struct shofer_dev *Shofer = NULL;
 struct buffer *Buffer = NULL;
 static dev_t Dev_no = 0;
 
+/* keeps buffers cache line aligned, as declared in config.h */
+static struct kmem_cache *buffer_cache;
+
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
 static void buffer_delete(struct buffer *);
@@ -84,6 +89,12 @@ static int __init shofer_module_init(void)
 	/* buffer size must be a power of 2 */
 	if (!is_power_of_2(buffer_size))
 		buffer_size = roundup_pow_of_two(buffer_size);
+	buffer_cache = kmem_cache_create("shofer_buffer", sizeof(struct buffer),
+		__alignof__(struct buffer), SLAB_HWCACHE_ALIGN, NULL);
+	if (!buffer_cache) {
+		retval = -ENOMEM;
+		goto no_driver;
+	}
 	buffer = buffer_create(buffer_size, &retval);
 	if (!buffer)
 		goto no_driver;
@@ -113,6 +124,7 @@ static void cleanup(void) {
 		shofer_delete(Shofer);
 	if (Buffer)
 		buffer_delete(Buffer);
+	kmem_cache_destroy(buffer_cache);
 	if (Dev_no)
 		unregister_chrdev_region(Dev_no, 1);
 }
@@ -128,22 +140,33 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/*
+ * Create and initialize a single buffer
+ * Data is allocated separately from buffer; with kvmalloc it needs not be
+ * physically contiguous, so buffer can be large (many pages).
+ */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
-	if (!buffer) {
+	struct buffer *buffer = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+	void *data = kvmalloc(size, GFP_KERNEL);
+	if (!buffer || !data) {
+		if (buffer)
+			kmem_cache_free(buffer_cache, buffer);
+		kvfree(data);
 		*retval = -ENOMEM;
 		printk(KERN_NOTICE "shofer:kmalloc failed\n");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = kfifo_init(&buffer->fifo, data, size);
 	if (*retval) {
-		kfree(buffer);
+		kvfree(data);
+		kmem_cache_free(buffer_cache, buffer);
 		printk(KERN_NOTICE "shofer:kfifo_init failed\n");
 		return NULL;
 	}
 	mutex_init(&buffer->lock);
+	init_waitqueue_head(&buffer->rq);
+	init_waitqueue_head(&buffer->wq);
 	*retval = 0;
 
 	return buffer;
@@ -151,7 +174,8 @@ static struct buffer *buffer_create(size_t size, int *retval)
 
 static void buffer_delete(struct buffer *buffer)
 {
-	kfree(buffer);
+	kvfree(buffer->fifo.kfifo.data);
+	kmem_cache_free(buffer_cache, buffer);
 }
 
 /* Create and initialize a single shofer_dev */
@@ -214,9 +238,22 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	struct kfifo *fifo = &buffer->fifo;
 	unsigned int copied;
 
+	if (count == 0)
+		return 0;
+
 	if (mutex_lock_interruptible(&buffer->lock))
 		return -ERESTARTSYS;
 
+	while (kfifo_is_empty(fifo)) { /* nothing to read */
+		mutex_unlock(&buffer->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(buffer->rq, !kfifo_is_empty(fifo)))
+			return -ERESTARTSYS; /* signal */
+		if (mutex_lock_interruptible(&buffer->lock))
+			return -ERESTARTSYS;
+	}
+
 	dump_buffer(buffer);
 
 	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
@@ -229,6 +266,8 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 
 	mutex_unlock(&buffer->lock);
 
+	wake_up_interruptible(&buffer->wq); /* space freed for writers */
+
 	return retval;
 }
 
@@ -242,9 +281,22 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	struct kfifo *fifo = &buffer->fifo;
 	unsigned int copied;
 
+	if (count == 0)
+		return 0;
+
 	if (mutex_lock_interruptible(&buffer->lock))
 		return -ERESTARTSYS;
 
+	while (kfifo_is_full(fifo)) { /* buffer full */
+		mutex_unlock(&buffer->lock);
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(buffer->wq, !kfifo_is_full(fifo)))
+			return -ERESTARTSYS; /* signal */
+		if (mutex_lock_interruptible(&buffer->lock))
+			return -ERESTARTSYS;
+	}
+
 	dump_buffer(buffer);
 
 	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
@@ -257,6 +309,8 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 
 	mutex_unlock(&buffer->lock);
 
+	wake_up_interruptible(&buffer->rq); /* data for readers */
+
 	return retval;
 }
 
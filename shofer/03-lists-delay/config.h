@@ -20,20 +20,22 @@
 #define BUFFER_NUM	6
 #define DRIVER_NUM	6
 
-/* Circular buffer */
+/*
+ * Circular buffer
+ * fifo metadata and lock are on separate cache lines; data is allocated
+ * separately (kvmalloc), so it can be large.
+ */
 struct buffer {
 	struct kfifo fifo;
-	struct mutex lock;	/* prevent parallel access */
-	struct list_head list;
+	struct mutex lock ____cacheline_aligned_in_smp; /* prevent parallel access */
 	int id;			/* id to differentiate buffers in prints */
-};
+} ____cacheline_aligned_in_smp;
 
 /* Device driver */
 struct shofer_dev {
 	dev_t dev_no;		/* device number */
 	struct buffer *buffer;	/* Pointer to buffer */
 	struct cdev cdev;	/* Char device structure */
-	struct list_head list;
 	int id;			/* id to differentiate drivers in prints */
 };
 
@@ -1,7 +1,7 @@
 /*
  * shofer.c -- module implementation
  *
- * Example module with devices, lists, klog, delay
+ * Example module with devices, tables (xarray), klog, delay
  *
  * Copyright (C) 2021 Leonardo Jelenkovic
  *
@@ -16,18 +16,21 @@
 #include <linux/init.h>
 
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/errno.h>
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
+#include <linux/xarray.h>
 
 #include "config.h"
 
 static int buffer_size = BUFFER_SIZE;	/* Buffer size */
 static int buffer_num = BUFFER_NUM;	/* Number of buffers */
 static int driver_num = DRIVER_NUM;	/* Number of drivers */
+static int delay_ms = 0;		/* Latency injection, 0 = off */
 
 /* Some parameters can be given at module load time */
 module_param(buffer_size, int, S_IRUGO);
@@ -36,12 +39,19 @@ module_param(buffer_num, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_num, "Number of buffers to create");
 module_param(driver_num, int, S_IRUGO);
 MODULE_PARM_DESC(driver_num, "Number of devices to create");
+/* can also be changed at runtime: /sys/module/shofer/parameters/delay_ms */
+module_param(delay_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(delay_ms, "Delay added to each read and write in ms (0=off)");
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
-static LIST_HEAD(buffers_list);
-static LIST_HEAD(shofers_list); /* A list of devices */
+/* buffers by id and devices by minor number (for open) */
+static DEFINE_XARRAY(buffers);
+static DEFINE_XARRAY(shofers);
+
+/* struct buffer is cache line aligned; kmalloc doesn't guarantee that */
+static struct kmem_cache *buffer_cache;
 
 static dev_t Dev_no = 0;
 
@@ -72,6 +82,7 @@ static int __init shofer_module_init(void)
 	int retval, i;
 	struct buffer *buffer;
 	struct shofer_dev *shofer;
+	unsigned long index;
 	dev_t dev_no = 0;
 
 	klog(KERN_NOTICE, "Module started initialization");
@@ -84,33 +95,43 @@ static int __init shofer_module_init(void)
 	}
 	Dev_no = dev_no; //remember first
 
-	/* Create and add buffers to the list */
+	buffer_cache = kmem_cache_create("shofer_buffer", sizeof(struct buffer),
+		__alignof__(struct buffer), SLAB_HWCACHE_ALIGN, NULL);
+	if (!buffer_cache) {
+		retval = -ENOMEM;
+		goto no_driver;
+	}
+
+	/* Create and add buffers to the table (ids are 0 to buffer_num-1) */
 	for (i = 0; i < buffer_num; i++) {
 		buffer = buffer_create(buffer_size, &retval);
 		if (!buffer)
 			goto no_driver;
-		list_add_tail(&buffer->list, &buffers_list);
+		retval = xa_insert(&buffers, buffer->id, buffer, GFP_KERNEL);
+		if (retval) {
+			buffer_delete(buffer);
+			goto no_driver;
+		}
 	}
 
-	/* Create and add devices to the list */
+	/* Create and add devices to the table */
 	for (i = 0; i < driver_num; i++) {
 		shofer = shofer_create(dev_no, &shofer_fops, NULL, &retval);
 		if (!shofer)
 			goto no_driver;
-		list_add_tail(&shofer->list, &shofers_list);
+		retval = xa_insert(&shofers, MINOR(dev_no), shofer, GFP_KERNEL);
+		if (retval) {
+			shofer_delete(shofer);
+			goto no_driver;
+		}
 		dev_no = MKDEV(MAJOR(dev_no), MINOR(dev_no) + 1);
 	}
 
 	/* assign buffers to devices in round robin fashion */
-	buffer = list_first_entry(&buffers_list, struct buffer, list);
-	list_for_each_entry(shofer, &shofers_list, list) {
+	xa_for_each(&shofers, index, shofer) {
+		buffer = xa_load(&buffers, index % buffer_num);
 		shofer->buffer = buffer;
 		dump_buffer("shofer-initilized", shofer, buffer);
-		if (!list_is_last(&buffer->list, &buffers_list))
-			buffer = list_next_entry(buffer, list);
-		else
-			buffer = list_first_entry(&buffers_list, struct buffer,
-				list);
 	}
 
 	klog(KERN_NOTICE, "Module initialized with major=%d", MAJOR(dev_no));
@@ -125,17 +146,19 @@ no_driver:
 
 static void cleanup(void)
 {
-	struct buffer *buffer, *b;
-	struct shofer_dev *shofer, *s;
+	struct buffer *buffer;
+	struct shofer_dev *shofer;
+	unsigned long index;
 
-	list_for_each_entry_safe (shofer, s, &shofers_list, list) {
-		list_del (&shofer->list);
+	xa_for_each(&shofers, index, shofer) {
+		xa_erase(&shofers, index);
 		shofer_delete(shofer);
 	}
-	list_for_each_entry_safe (buffer, b, &buffers_list, list) {
-		list_del (&buffer->list);
+	xa_for_each(&buffers, index, buffer) {
+		xa_erase(&buffers, index);
 		buffer_delete(buffer);
 	}
+	kmem_cache_destroy(buffer_cache); /* all buffers are deleted */
 
 	if (Dev_no)
 		unregister_chrdev_region(Dev_no, driver_num);
@@ -152,18 +175,23 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/* Create and initialize a single buffer (data with kvmalloc, see config.h) */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
 	static int buffer_id = 0;
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
-	if (!buffer) {
+	struct buffer *buffer = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+	void *data = kvmalloc(size, GFP_KERNEL);
+	if (!buffer || !data) {
+		if (buffer)
+			kmem_cache_free(buffer_cache, buffer);
+		kvfree(data);
 		*retval = -ENOMEM;
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = kfifo_init(&buffer->fifo, data, size);
 	if (*retval) {
-		kfree(buffer);
+		kvfree(data);
+		kmem_cache_free(buffer_cache, buffer);
 		klog(KERN_WARNING, "kfifo_init failed\n");
 		return NULL;
 	}
@@ -176,7 +204,8 @@ static struct buffer *buffer_create(size_t size, int *retval)
 
 static void buffer_delete(struct buffer *buffer)
 {
-	kfree(buffer);
+	kvfree(buffer->fifo.kfifo.data);
+	kmem_cache_free(buffer_cache, buffer);
 }
 
 /* Create and initialize a single shofer_dev */
@@ -217,7 +246,9 @@ static int shofer_open(struct inode *inode, struct file *filp)
 {
 	struct shofer_dev *shofer;
 
-	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
+	shofer = xa_load(&shofers, iminor(inode)); /* table is fixed after init */
+	if (!shofer)
+		return -ENODEV;
 	filp->private_data = shofer;
 
 	return 0;
@@ -243,12 +274,14 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	else
 		retval = copied;
 
-	simulate_delay(1000);
-
 	dump_buffer("read-end", shofer, buffer);
 
 	mutex_unlock(&buffer->lock);
 
+	/* delay outside of critical section, other users can proceed */
+	if (delay_ms > 0)
+		simulate_delay(delay_ms);
+
 	return retval;
 }
 
@@ -272,12 +305,14 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	else
 		retval = copied;
 
-	simulate_delay(1000);
-
 	dump_buffer("write-end", shofer, buffer);
 
 	mutex_unlock(&buffer->lock);
 
+	/* delay outside of critical section, other users can proceed */
+	if (delay_ms > 0)
+		simulate_delay(delay_ms);
+
 	return retval;
 }
 
@@ -22,42 +22,63 @@
 
 #define TIMER_PERIOD	500 /* each 500 ms */
 
-/* Circular buffer */
+#define BOUNCE_NUM	8 /* bounce buffers kept in free list */
+
+/* When queued read/write work is done */
+#define POLICY_IMMEDIATE	0 /* as soon as possible */
+#define POLICY_BATCH		1 /* with other requests, within MAX_DELAY_MS */
+#define POLICY_DELAY		2 /* after DELAY_MS (latency injection) */
+
+#define MAX_DELAY_MS	10
+#define DELAY_MS	500
+
+/*
+ * Circular buffer
+ * fifo metadata and lock are on separate cache lines; data is allocated
+ * separately (kvmalloc), so it can be large.
+ */
 struct buffer {
 	struct kfifo fifo;
 	//struct mutex lock;	/* can't use them in timers; spinlocks instead */
-	spinlock_t key;		/* for locking with timers, tasklets, ... */
-	struct list_head list;
+	spinlock_t key ____cacheline_aligned_in_smp; /* with timers: _bh in process context */
+	unsigned long batch_end; /* end of current batch window (jiffies) */
+	struct list_head pending; /* requests waiting for work (wq_data) */
 	int id;			/* id to differentiate buffers in prints */
-};
+	struct delayed_work work; /* processes pending requests */
+	struct workqueue_struct *wq; /* work is always queued here */
+} ____cacheline_aligned_in_smp;
 
 /* Device driver */
 struct shofer_dev {
 	dev_t dev_no;		/* device number */
 	struct buffer *buffer;	/* Pointer to buffer */
 	struct cdev cdev;	/* Char device structure */
-	struct list_head list;
 	int id;			/* id to differentiate drivers in prints */
 	struct mutex lock;	/* prevent parallel access */
 
-	struct workqueue_struct *rwq;	/* reader workqueue, one per shofer */
-	struct workqueue_struct *wwq;	/* writter workqueue, one per shofer */
-
 	/* for tasks waiting for work in workqueue to be done */
 	struct wait_queue_head wqueue;
 };
 
 struct wq_data {
-	struct work_struct work;
+	struct list_head list;		/* in buffer->pending */
+	unsigned long due;		/* when to process (jiffies) */
 	struct buffer *buffer;
 	char *buf;
 	size_t len;
 	unsigned int copied;
 	int op; /* 0 - read, 1- write */
+	bool done; /* set by worker when request is processed */
 	union {
 		struct wait_queue_head *queue;
 		struct completion *completion;
 	} wakeup;
+
+	/* asynchronous request only (wqd is allocated, not on stack) */
+	struct kiocb *iocb;		/* NULL for synchronous request */
+	struct iov_iter iter;		/* read: where to copy data */
+	const void *iov;		/* read: copy of caller's iovec array */
+	struct mm_struct *mm;		/* read: caller's address space */
 };
 
 
@@ -17,6 +17,7 @@
 
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/types.h>
@@ -28,13 +29,31 @@
 #include <linux/interrupt.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
+#include <linux/xarray.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/sched/mm.h>
+#include <linux/kthread.h>
+#include <linux/version.h>
 
 #include "config.h"
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+#define shofer_ki_complete(iocb, res)	(iocb)->ki_complete(iocb, res, 0)
+#define shofer_fault_in(iter, n)	iov_iter_fault_in_readable(iter, n)
+#else
+#define shofer_ki_complete(iocb, res)	(iocb)->ki_complete(iocb, res)
+#define shofer_fault_in(iter, n)	fault_in_iov_iter_readable(iter, n)
+#endif
+
 static int buffer_size = BUFFER_SIZE;	/* Buffer size */
 static int buffer_num = BUFFER_NUM;	/* Number of buffers */
 static int driver_num = DRIVER_NUM;	/* Number of drivers */
+static int bounce_num = BOUNCE_NUM;	/* Reserved bounce buffers */
+static bool direct_write = false;	/* Write without work and bounce */
+static int policy = POLICY_IMMEDIATE;	/* When queued work is done */
+static int max_delay_ms = MAX_DELAY_MS;	/* Batch window (POLICY_BATCH) */
+static int delay_ms = DELAY_MS;		/* Injected latency (POLICY_DELAY) */
 
 /* Some parameters can be given at module load time */
 module_param(buffer_size, int, S_IRUGO);
@@ -43,17 +62,45 @@ module_param(buffer_num, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_num, "Number of buffers to create");
 module_param(driver_num, int, S_IRUGO);
 MODULE_PARM_DESC(driver_num, "Number of devices to create");
+module_param(bounce_num, int, S_IRUGO);
+MODULE_PARM_DESC(bounce_num, "Number of bounce buffers kept for requests");
+module_param(direct_write, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(direct_write, "Copy written data directly into buffer");
+/* processing policy can be changed at runtime, in /sys/module/shofer/ */
+module_param(policy, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(policy, "Work processing: 0-immediate, 1-batch, 2-delay");
+module_param(max_delay_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_delay_ms, "Batch: max time request waits for others (ms)");
+module_param(delay_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(delay_ms, "Delay: latency added to each request (ms)");
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
-static LIST_HEAD(buffers_list);
-static LIST_HEAD(shofers_list); /* A list of devices */
+/* buffers by id (timer) and devices by minor number (open) */
+static DEFINE_XARRAY(buffers);
+static DEFINE_XARRAY(shofers);
+
+/* buffers, aligned to cache line as declared in config.h */
+static struct kmem_cache *buffer_cache;
 
 static dev_t Dev_no = 0;
 
 static struct timer_list timer;
 
+/* work requests (asynchronous), reused across requests */
+static struct kmem_cache *wqd_cache;
+
+/* bounce buffers: bounce_num are preallocated and kept in free list */
+struct bounce {
+	struct bounce *next;	/* in unused buffer */
+};
+static struct bounce *bounce_list;
+static int bounce_count;	/* buffers in bounce_list */
+static DEFINE_SPINLOCK(bounce_lock);
+static DECLARE_WAIT_QUEUE_HEAD(bounce_wait);
+#define BOUNCE_SIZE	max_t(size_t, buffer_size, sizeof(struct bounce))
+
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
 static void buffer_delete(struct buffer *);
@@ -65,24 +112,85 @@ static void dump_buffer(char *, struct shofer_dev *, struct buffer *);
 //static void simulate_delay(long delay_ms);
 static void timer_function(struct timer_list *t);
 static void workqueue_operations(struct work_struct *work);
+static void queue_request(struct wq_data *);
 
 static int shofer_open(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_async(struct shofer_dev *, struct kiocb *,
+	struct iov_iter *, size_t, int);
+static void shofer_async_complete(struct wq_data *);
+static ssize_t shofer_nowait(struct buffer *, struct iov_iter *, size_t, int);
+static ssize_t shofer_direct_write(struct buffer *, struct iov_iter *, size_t);
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
-	.read =     shofer_read,
-	.write =    shofer_write
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter
 };
 
+/* Take a buffer from free list, NULL if it is empty */
+static void *bounce_take(void)
+{
+	struct bounce *b;
+
+	spin_lock(&bounce_lock);
+	b = bounce_list;
+	if (b) {
+		bounce_list = b->next;
+		bounce_count--;
+	}
+	spin_unlock(&bounce_lock);
+
+	return b;
+}
+
+/*
+ * Get a bounce buffer (buffer_size bytes): from free list, or allocated
+ * (kvmalloc) when all are in use. If allocation fails and gfp allows it,
+ * waits for a buffer to be returned to the list.
+ */
+static void *bounce_get(gfp_t gfp)
+{
+	void *buf = bounce_take();
+
+	if (!buf)
+		buf = kvmalloc(BOUNCE_SIZE, gfp);
+	if (!buf && gfpflags_allow_blocking(gfp))
+		wait_event(bounce_wait, (buf = bounce_take()) != NULL);
+
+	return buf;
+}
+
+/* Return buffer to free list; ones above bounce_num are freed */
+static void bounce_put(void *buf)
+{
+	struct bounce *b = buf;
+
+	spin_lock(&bounce_lock);
+	if (bounce_count < bounce_num) {
+		b->next = bounce_list;
+		bounce_list = b;
+		bounce_count++;
+		b = NULL;
+	}
+	spin_unlock(&bounce_lock);
+
+	if (b)
+		kvfree(b);
+	else
+		wake_up(&bounce_wait);
+}
+
 /* init module */
 static int __init shofer_module_init(void)
 {
 	int retval, i;
 	struct buffer *buffer;
+	void *buf;
 	struct shofer_dev *shofer;
+	unsigned long index;
 	dev_t dev_no = 0;
 
 	klog(KERN_NOTICE, "Module started initialization");
@@ -95,32 +203,62 @@ static int __init shofer_module_init(void)
 	}
 	Dev_no = dev_no; //remember first
 
-	/* Create and add buffers to the list */
+	/* work requests and bounce buffers */
+	wqd_cache = kmem_cache_create("shofer_wq_data", sizeof(struct wq_data),
+		0, 0, NULL);
+	if (!wqd_cache) {
+		klog(KERN_WARNING, "Can't create request caches");
+		retval = -ENOMEM;
+		goto no_driver;
+	}
+	/* bounce buffers: request is never larger than buffer */
+	for (i = 0; i < bounce_num; i++) {
+		buf = kvmalloc(BOUNCE_SIZE, GFP_KERNEL);
+		if (!buf) {
+			klog(KERN_WARNING, "Can't allocate bounce buffers");
+			retval = -ENOMEM;
+			goto no_driver;
+		}
+		bounce_put(buf);
+	}
+
+	buffer_cache = kmem_cache_create("shofer_buffer", sizeof(struct buffer),
+		__alignof__(struct buffer), SLAB_HWCACHE_ALIGN, NULL);
+	if (!buffer_cache) {
+		retval = -ENOMEM;
+		goto no_driver;
+	}
+
+	/* Create and add buffers to the table (ids are 0 to buffer_num-1) */
 	for (i = 0; i < buffer_num; i++) {
 		buffer = buffer_create(buffer_size, &retval);
 		if (!buffer)
 			goto no_driver;
-		list_add_tail(&buffer->list, &buffers_list);
+		retval = xa_insert(&buffers, buffer->id, buffer, GFP_KERNEL);
+		if (retval) {
+			buffer_delete(buffer);
+			goto no_driver;
+		}
 	}
 
-	/* Create and add devices to the list */
+	/* Create and add devices to the table */
 	for (i = 0; i < driver_num; i++) {
 		shofer = shofer_create(dev_no, &shofer_fops, NULL, &retval);
 		if (!shofer)
 			goto no_driver;
-		list_add_tail(&shofer->list, &shofers_list);
+		retval = xa_insert(&shofers, MINOR(dev_no), shofer, GFP_KERNEL);
+		if (retval) {
+			shofer_delete(shofer);
+			goto no_driver;
+		}
 		dev_no = MKDEV(MAJOR(dev_no), MINOR(dev_no) + 1);
 	}
 
 	/* assign buffers to devices in round robin fashion */
-	buffer = list_first_entry(&buffers_list, struct buffer, list);
-	list_for_each_entry(shofer, &shofers_list, list) {
+	xa_for_each(&shofers, index, shofer) {
+		buffer = xa_load(&buffers, index % buffer_num);
 		shofer->buffer = buffer;
 		dump_buffer("shofer-initilized", shofer, buffer);
-		if (!list_is_last(&buffer->list, &buffers_list))
-			buffer = list_next_entry(buffer, list);
-		else
-			buffer = list_first_entry(&buffers_list, struct buffer, list);
 	}
 
 	/* Create timer that will periodically put content in first buffer */
@@ -140,22 +278,31 @@ no_driver:
 
 static void cleanup(void)
 {
-	struct buffer *buffer, *b;
-	struct shofer_dev *shofer, *s;
+	struct buffer *buffer;
+	struct shofer_dev *shofer;
+	unsigned long index;
+
+	/* timer uses first buffer: stop it before buffers are deleted */
+	if (timer.function)
+		del_timer_sync(&timer);
 
-	list_for_each_entry_safe (shofer, s, &shofers_list, list) {
-		list_del (&shofer->list);
+	xa_for_each(&shofers, index, shofer) {
+		xa_erase(&shofers, index);
 		shofer_delete(shofer);
 	}
-	list_for_each_entry_safe (buffer, b, &buffers_list, list) {
-		list_del (&buffer->list);
+	xa_for_each(&buffers, index, buffer) {
+		xa_erase(&buffers, index);
 		buffer_delete(buffer);
 	}
+	kmem_cache_destroy(buffer_cache); /* all buffers are deleted */
 
 	if (Dev_no)
 		unregister_chrdev_region(Dev_no, driver_num);
 
-	del_timer(&timer);
+	/* workqueues are destroyed; no request uses them any more */
+	while (bounce_count)
+		kvfree(bounce_take());
+	kmem_cache_destroy(wqd_cache);
 }
 
 /* called when module exit */
@@ -169,23 +316,44 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/* Create and initialize a single buffer (data with kvmalloc, see config.h) */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
 	static int buffer_id = 0;
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
-	if (!buffer) {
+	struct buffer *buffer = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+	void *data = kvmalloc(size, GFP_KERNEL);
+	if (!buffer || !data) {
+		if (buffer)
+			kmem_cache_free(buffer_cache, buffer);
+		kvfree(data);
 		*retval = -ENOMEM;
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = kfifo_init(&buffer->fifo, data, size);
 	if (*retval) {
-		kfree(buffer);
+		kvfree(data);
+		kmem_cache_free(buffer_cache, buffer);
 		klog(KERN_WARNING, "kfifo_init failed\n");
 		return NULL;
 	}
 	buffer->id = buffer_id++;
+
+	/*
+	 * Unbound workqueue: workers are managed by kernel, not tied to cpu,
+	 * and requests on different buffers don't wait for each other
+	 */
+	buffer->wq = alloc_workqueue("shofer_buf%d", WQ_UNBOUND, 0, buffer->id);
+	if (!buffer->wq) {
+		kvfree(data);
+		kmem_cache_free(buffer_cache, buffer);
+		klog(KERN_WARNING, "alloc_workqueue error");
+		*retval = -ENOMEM;
+		return NULL;
+	}
 	spin_lock_init(&buffer->key);
+	buffer->batch_end = jiffies;
+	INIT_LIST_HEAD(&buffer->pending);
+	INIT_DELAYED_WORK(&buffer->work, workqueue_operations);
 
 	*retval = 0;
 
@@ -193,7 +361,10 @@ static struct buffer *buffer_create(size_t size, int *retval)
 }
 static void buffer_delete(struct buffer *buffer)
 {
-	kfree(buffer);
+	cancel_delayed_work_sync(&buffer->work);
+	destroy_workqueue(buffer->wq);
+	kvfree(buffer->fifo.kfifo.data);
+	kmem_cache_free(buffer_cache, buffer);
 }
 
 /* Create and initialize a single shofer_dev */
@@ -202,7 +373,6 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 {
 	static int shofer_id = 0;
 	struct shofer_dev *shofer;
-	char wqname[8];
 
 	shofer = kmalloc(sizeof(struct shofer_dev), GFP_KERNEL);
 	if (!shofer){
@@ -228,36 +398,6 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 	/* queue for tasks waiting on write workqueue completion */
 	init_waitqueue_head(&shofer->wqueue);
 
-	wqname[0] = 'r';
-	wqname[1] = 'w';
-	wqname[2] = 'q';
-	wqname[3] = '0' + shofer->id/1000 % 10;
-	wqname[4] = '0' + shofer->id/100 % 10;
-	wqname[5] = '0' + shofer->id/10 % 10;
-	wqname[6] = '0' + shofer->id % 10;
-	wqname[7] = 0;
-
-	shofer->rwq = create_singlethread_workqueue(wqname);
-	if (!shofer->rwq) {
-		klog(KERN_WARNING, "create_singlethread_workqueue error");
-		kfree(shofer);
-		*retval = -ENOMEM;
-		shofer->rwq = NULL;
-		return NULL;
-	}
-
-	wqname[0] = 'w';
-	shofer->wwq = create_singlethread_workqueue(wqname);
-	if (!shofer->wwq) {
-		klog(KERN_WARNING, "create_singlethread_workqueue error");
-		destroy_workqueue(shofer->rwq);
-		kfree(shofer);
-		*retval = -ENOMEM;
-		shofer->rwq = NULL;
-		shofer->wwq = NULL;
-		return NULL;
-	}
-
 	mutex_init(&shofer->lock);
 
 	return shofer;
@@ -267,11 +407,6 @@ static void shofer_delete(struct shofer_dev *shofer)
 {
 	cdev_del(&shofer->cdev);
 
-	if(shofer->rwq)
-		destroy_workqueue(shofer->rwq);
-	if(shofer->wwq)
-		destroy_workqueue(shofer->wwq);
-
 	kfree(shofer);
 }
 
@@ -280,20 +415,25 @@ static int shofer_open(struct inode *inode, struct file *filp)
 {
 	struct shofer_dev *shofer; /* device information */
 
-	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
+	shofer = xa_load(&shofers, iminor(inode)); /* table is fixed after init */
+	if (!shofer)
+		return -ENODEV;
 	filp->private_data = shofer; /* for other methods */
 
+	/* IOCB_NOWAIT is supported (io_uring won't need a worker thread) */
+	filp->f_mode |= FMODE_NOWAIT;
+
 	return 0;
 }
 
-/* use workqueues to copy data from buffer */
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos)
+/* use workqueues to copy data from buffer (read, readv, aio, io_uring) */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
 	struct kfifo *fifo = &buffer->fifo;
+	size_t count = iov_iter_count(to);
 	size_t fifo_len;
 	char *buf = NULL;
 	struct wq_data wqd; /* reserved on stack, since here we wait */
@@ -302,23 +442,25 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	if (count == 0)
 		return 0;
 
-	spin_lock(&buffer->key); /* prevent timers, tasklets, ... */
+	spin_lock_bh(&buffer->key); /* prevent timers, tasklets, ... */
 
 	dump_buffer("read-start", shofer, buffer);
 	fifo_len = kfifo_len(fifo);
 	if (count > fifo_len) /* enough bytes in buffer? */
 		count = fifo_len;
 
-	spin_unlock(&buffer->key);
+	spin_unlock_bh(&buffer->key);
 
 	if (count == 0)
 		return 0;
 
-	buf = kmalloc(count, GFP_KERNEL);
-	if (!buf){
-		klog(KERN_WARNING, "kmalloc failed\n");
-		return -ENOMEM;
-	}
+	if (iocb->ki_flags & IOCB_NOWAIT) /* caller can't wait for work */
+		return shofer_nowait(buffer, to, count, 0);
+
+	if (!is_sync_kiocb(iocb)) /* caller don't want to wait for work */
+		return shofer_async(shofer, iocb, to, count, 0);
+
+	buf = bounce_get(GFP_KERNEL); /* waits, don't fail */
 
 	/* create a job that will copy data from 'buffer' to 'buf' */
 	wqd.buf = buf;
@@ -326,46 +468,41 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	wqd.copied = 0;
 	wqd.buffer = buffer;
 	wqd.op = 0; /* read */
+	wqd.done = false;
+	wqd.iocb = NULL;
 	wqd.wakeup.completion = &wq_reader;
 
-	INIT_WORK(&wqd.work, workqueue_operations);
 	init_completion(&wq_reader);
 
 	mutex_lock(&shofer->lock);
-	if (!queue_work(shofer->rwq, &wqd.work)) {
-		/* not added */
-		LOG("work not added to workqueue!");
-		retval = -EFAULT;
-	}
+	queue_request(&wqd);
 	mutex_unlock(&shofer->lock);
 
-	if (!retval) {
-		wait_for_completion(&wq_reader);
-		retval = wqd.copied;
-		if (copy_to_user(ubuf, buf, wqd.copied)) {
-			klog(KERN_WARNING, "copy_to_user failed\n");
-			kfree(buf);
-			return -EFAULT;
-		}
+	wait_for_completion(&wq_reader);
+	retval = wqd.copied;
+	if (copy_to_iter(buf, wqd.copied, to) != wqd.copied) {
+		klog(KERN_WARNING, "copy_to_iter failed\n");
+		bounce_put(buf);
+		return -EFAULT;
 	}
 
-	spin_lock(&buffer->key);
+	spin_lock_bh(&buffer->key);
 	dump_buffer("read-end", shofer, buffer);
-	spin_unlock(&buffer->key);
+	spin_unlock_bh(&buffer->key);
 
-	kfree(buf);
+	bounce_put(buf);
 
 	return retval;
 }
 
-/* use workqueues to copy data to buffer */
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos)
+/* use workqueues to copy data to buffer (write, writev, aio, io_uring) */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
 	struct buffer *buffer = shofer->buffer;
 	struct kfifo *fifo = &buffer->fifo;
+	size_t count = iov_iter_count(from);
 	size_t fifo_free;
 	char *buf = NULL;
 	struct wq_data wqd; /* reserved on stack, since here we wait */
@@ -373,27 +510,32 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	if (count == 0)
 		return 0;
 
-	spin_lock(&buffer->key);
+	spin_lock_bh(&buffer->key);
 
 	dump_buffer("write-start", shofer, buffer);
 	fifo_free = kfifo_avail(fifo);
 	if (count > fifo_free) /* enough free space in buffer? */
 		count = fifo_free; /* don't write all given data */
 
-	spin_unlock(&buffer->key);
+	spin_unlock_bh(&buffer->key);
 
 	if (count == 0)
 		return 0;
 
+	if (iocb->ki_flags & IOCB_NOWAIT) /* caller can't wait for work */
+		return shofer_nowait(buffer, from, count, 1);
+
+	if (direct_write) /* no work needed: copy from user to buffer */
+		return shofer_direct_write(buffer, from, count);
+
+	if (!is_sync_kiocb(iocb)) /* caller don't want to wait for work */
+		return shofer_async(shofer, iocb, from, count, 1);
+
 	/* first, copy data from user space to 'buf' */
-	buf = kmalloc(count, GFP_KERNEL);
-	if (!buf){
-		klog(KERN_WARNING, "kmalloc failed\n");
-		return -ENOMEM;
-	}
-	if (copy_from_user(buf, ubuf, count)) {
-		klog(KERN_WARNING, "copy_from_user failed\n");
-		kfree(buf);
+	buf = bounce_get(GFP_KERNEL);
+	if (copy_from_iter(buf, count, from) != count) {
+		klog(KERN_WARNING, "copy_from_iter failed\n");
+		bounce_put(buf);
 		return -EFAULT;
 	}
 	/* create a job that will copy data from 'buf' into "buffer" */
@@ -402,31 +544,175 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	wqd.copied = 0;
 	wqd.buffer = buffer;
 	wqd.op = 1; /* write */
+	wqd.done = false;
+	wqd.iocb = NULL;
 	wqd.wakeup.queue = &shofer->wqueue;
 
-	INIT_WORK(&wqd.work, workqueue_operations);
-
 	mutex_lock(&shofer->lock);
-	if (!queue_work(shofer->wwq, &wqd.work)) {
-		/* not added */
-		LOG("work not added to workqueue!");
-		retval = -EFAULT;
-	}
+	queue_request(&wqd);
 	mutex_unlock(&shofer->lock);
-	if (!retval) {
-		wait_event(shofer->wqueue, wqd.copied > 0);
-		retval = wqd.copied;
-	}
 
-	spin_lock(&buffer->key);
+	/* buffer could be filled by others meanwhile: copied can be 0 */
+	wait_event(shofer->wqueue, smp_load_acquire(&wqd.done));
+	retval = wqd.copied;
+
+	spin_lock_bh(&buffer->key);
 	dump_buffer("write-end", shofer, buffer);
-	spin_unlock(&buffer->key);
+	spin_unlock_bh(&buffer->key);
 
-	kfree(buf);
+	bounce_put(buf);
 
 	return retval;
 }
 
+/*
+ * Asynchronous request (aio, io_uring): queue work and return immediately
+ * Worker finishes the request and reports result with ki_complete (for aio
+ * it can also be signaled through eventfd, IOCB_FLAG_RESFD).
+ * For read, worker copies data directly into caller's address space.
+ */
+static ssize_t shofer_async(struct shofer_dev *shofer, struct kiocb *iocb,
+	struct iov_iter *iter, size_t count, int op)
+{
+	gfp_t gfp = GFP_KERNEL; /* IOCB_NOWAIT requests don't come here */
+	struct wq_data *wqd;
+
+	wqd = kmem_cache_zalloc(wqd_cache, gfp);
+	if (!wqd)
+		return -EAGAIN;
+	wqd->buf = bounce_get(gfp);
+	if (!wqd->buf) {
+		kmem_cache_free(wqd_cache, wqd);
+		return -EAGAIN;
+	}
+
+	if (op) {
+		/* data can be taken now, while in caller's context */
+		if (copy_from_iter(wqd->buf, count, iter) != count) {
+			bounce_put(wqd->buf);
+			kmem_cache_free(wqd_cache, wqd);
+			return -EFAULT;
+		}
+	} else {
+		/* caller's iovec array won't exist after return; copy it */
+		wqd->iov = dup_iter(&wqd->iter, iter, gfp);
+		if (!wqd->iov && iter_is_iovec(iter)) {
+			bounce_put(wqd->buf);
+			kmem_cache_free(wqd_cache, wqd);
+			return -ENOMEM;
+		}
+		wqd->mm = current->mm;
+		mmget(wqd->mm);
+	}
+
+	wqd->len = count;
+	wqd->buffer = shofer->buffer;
+	wqd->op = op;
+	wqd->iocb = iocb;
+
+	mutex_lock(&shofer->lock);
+	queue_request(wqd);
+	mutex_unlock(&shofer->lock);
+
+	return -EIOCBQUEUED;
+}
+
+/* Finish asynchronous request in worker */
+static void shofer_async_complete(struct wq_data *wqd)
+{
+	ssize_t retval = wqd->copied;
+
+	if (!wqd->op) {
+		kthread_use_mm(wqd->mm);
+		if (copy_to_iter(wqd->buf, wqd->copied, &wqd->iter) != wqd->copied)
+			retval = -EFAULT;
+		kthread_unuse_mm(wqd->mm);
+		mmput(wqd->mm);
+		kfree(wqd->iov);
+	}
+
+	shofer_ki_complete(wqd->iocb, retval);
+
+	bounce_put(wqd->buf);
+	kmem_cache_free(wqd_cache, wqd);
+}
+
+/* IOCB_NOWAIT: do the operation immediately, without work and waiting */
+static ssize_t shofer_nowait(struct buffer *buffer, struct iov_iter *iter,
+	size_t count, int op)
+{
+	struct kfifo *fifo = &buffer->fifo;
+	unsigned int copied;
+	char *buf;
+
+	buf = bounce_get(GFP_NOWAIT);
+	if (!buf)
+		return -EAGAIN;
+
+	if (op) {
+		if (copy_from_iter(buf, count, iter) != count) {
+			bounce_put(buf);
+			return -EFAULT;
+		}
+		spin_lock_bh(&buffer->key);
+		copied = kfifo_in(fifo, buf, count);
+		spin_unlock_bh(&buffer->key);
+	} else {
+		spin_lock_bh(&buffer->key);
+		copied = kfifo_out(fifo, buf, count);
+		spin_unlock_bh(&buffer->key);
+		if (copy_to_iter(buf, copied, iter) != copied) {
+			bounce_put(buf);
+			return -EFAULT;
+		}
+	}
+
+	bounce_put(buf);
+
+	return copied;
+}
+
+/*
+ * Copy data from user directly into buffer, without work and bounce buffer
+ * Copy is done under spinlock (timer also adds data) with page faults
+ * disabled; when data isn't in memory, page is faulted in without the lock
+ * and copying continues.
+ */
+static ssize_t shofer_direct_write(struct buffer *buffer,
+	struct iov_iter *from, size_t count)
+{
+	struct __kfifo *f = &buffer->fifo.kfifo;
+	unsigned int size = f->mask + 1;
+	unsigned int off;
+	size_t done = 0, len, l, copied;
+
+	while (done < count) {
+		spin_lock_bh(&buffer->key);
+		pagefault_disable();
+
+		off = f->in & f->mask;
+		len = min_t(size_t, count - done, size - (f->in - f->out));
+		l = min_t(size_t, len, size - off);
+		copied = copy_from_iter((char *) f->data + off, l, from);
+		if (copied == l && len > l)
+			copied += copy_from_iter(f->data, len - l, from);
+		smp_wmb(); /* data before index, as in kfifo */
+		f->in += copied;
+
+		pagefault_enable();
+		spin_unlock_bh(&buffer->key);
+
+		done += copied;
+		if (copied == len) /* all copied or buffer is full */
+			break;
+
+		if (shofer_fault_in(from, count - done))
+			return done ? done : -EFAULT;
+	}
+
+	return done;
+}
+
 static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *b)
 {
 	char buf[BUFFER_SIZE];
@@ -444,7 +730,7 @@ static void timer_function(struct timer_list *t)
 	struct buffer *buffer;
 	struct kfifo *fifo;
 
-	buffer = list_first_entry(&buffers_list, struct buffer, list);
+	buffer = xa_load(&buffers, 0); /* timer is stopped before it is removed */
 	spin_lock(&buffer->key);
 	fifo = &buffer->fifo;
 	kfifo_put(fifo, 'T');
@@ -454,34 +740,103 @@ static void timer_function(struct timer_list *t)
 	mod_timer(t, jiffies + msecs_to_jiffies(TIMER_PERIOD));
 }
 
+/*
+ * Queue request according to processing policy
+ * Request is added to buffer's list of pending requests, with time when it
+ * is due. Instead of sleeping in worker, buffer's work is delayed with timer:
+ * - POLICY_IMMEDIATE: request is due right away
+ * - POLICY_BATCH: first request opens a window of max_delay_ms; all requests
+ *   on the buffer within the window are due when it ends
+ * - POLICY_DELAY: each request is delayed delay_ms (for tests)
+ * If buffer's work is already queued (for earlier requests), it isn't queued
+ * again: worker will take all due requests at once. Only when its timer
+ * would expire after this request is due, it is moved forward.
+ */
+static void queue_request(struct wq_data *wqd)
+{
+	struct buffer *buffer = wqd->buffer;
+	unsigned long now;
+
+	spin_lock_bh(&buffer->key);
+
+	now = jiffies;
+	switch (READ_ONCE(policy)) {
+	case POLICY_BATCH:
+		if (time_after_eq(now, buffer->batch_end))
+			buffer->batch_end = now + msecs_to_jiffies(max_delay_ms);
+		wqd->due = buffer->batch_end;
+		break;
+	case POLICY_DELAY:
+		wqd->due = now + msecs_to_jiffies(delay_ms);
+		break;
+	default:
+		wqd->due = now;
+	}
+	list_add_tail(&wqd->list, &buffer->pending);
+
+	spin_unlock_bh(&buffer->key);
+
+	if (!queue_delayed_work(buffer->wq, &buffer->work, wqd->due - now) &&
+	    time_before(wqd->due, READ_ONCE(buffer->work.timer.expires)))
+		mod_delayed_work(buffer->wq, &buffer->work, wqd->due - now);
+}
+
+/*
+ * Process all due requests on buffer (group commit)
+ * Spinlock is taken once for the whole group; requests are then completed
+ * one by one, without the lock. If some requests aren't due yet, work is
+ * queued again for the earliest of them.
+ */
 static void workqueue_operations(struct work_struct *work)
 {
-	struct wq_data *wqd;
+	struct wq_data *wqd, *w;
 	struct buffer *buffer;
 	struct kfifo *fifo;
+	struct wait_queue_head *queue;
+	LIST_HEAD(done);
+	unsigned long now, delay = 0;
+	bool more = false;
+	int n = 0;
 
-	/* delay work by 500 msec */
-	int retval;
-	wait_queue_head_t wait;
-	init_waitqueue_head (&wait);
-	retval = wait_event_interruptible_timeout(wait, 0,
-		msecs_to_jiffies(500));
-
-	wqd = container_of(work, struct wq_data, work);
-	buffer = wqd->buffer;
+	buffer = container_of(to_delayed_work(work), struct buffer, work);
 	fifo = &buffer->fifo;
 
-	spin_lock(&buffer->key);
+	spin_lock_bh(&buffer->key);
 
-	if (wqd->op)
-		wqd->copied = kfifo_in(fifo, wqd->buf, wqd->len);
-	else
-		wqd->copied = kfifo_out(fifo, wqd->buf, wqd->len);
+	now = jiffies;
+	list_for_each_entry_safe (wqd, w, &buffer->pending, list) {
+		if (time_before(now, wqd->due)) {
+			/* later requests may be due sooner (other policy) */
+			if (!more || wqd->due - now < delay)
+				delay = wqd->due - now;
+			more = true;
+			continue;
+		}
+		if (wqd->op)
+			wqd->copied = kfifo_in(fifo, wqd->buf, wqd->len);
+		else
+			wqd->copied = kfifo_out(fifo, wqd->buf, wqd->len);
+		list_move_tail(&wqd->list, &done);
+		n++;
+	}
 
-	spin_unlock(&buffer->key);
+	spin_unlock_bh(&buffer->key);
 
-	if (wqd->op)
-		wake_up_all(wqd->wakeup.queue);
-	else
-		complete(wqd->wakeup.completion);
+	LOG("buffer %d: %d requests processed", buffer->id, n);
+
+	if (more)
+		queue_delayed_work(buffer->wq, &buffer->work, delay);
+
+	list_for_each_entry_safe (wqd, w, &done, list) {
+		if (wqd->iocb) {
+			shofer_async_complete(wqd); /* frees wqd */
+		} else if (wqd->op) {
+			/* wqd is on waiter's stack: don't touch it after 'done' */
+			queue = wqd->wakeup.queue;
+			smp_store_release(&wqd->done, true);
+			wake_up_all(queue);
+		} else {
+			complete(wqd->wakeup.completion);
+		}
+	}
 }
@@ -19,24 +19,71 @@
 #define BUFFER_SIZE	64
 #define BUFFER_NUM	3
 #define DRIVER_NUM	3
+#define DRIVER_MAX	32	/* control device gets this minor */
+#define BUFFER_SIZE_MAX	(1 << 24)	/* for resize */
 
-/* Circular buffer */
-struct buffer {
+/* Per cpu write fifo of a sharded buffer */
+struct shard {
 	struct kfifo fifo;
-	struct mutex lock;	/* prevent parallel access */
-	struct list_head list;
-	int id;			/* id to differentiate buffers in prints */
+	struct mutex lock;	/* writers on this shard; reader uses buffer lock */
 };
 
+/*
+ * Circular buffer
+ * Fields are grouped by use so that hot lock, fifo metadata and wait queues
+ * are each on their own cache line (allocated from cache line aligned
+ * kmem_cache).
+ */
+struct buffer {
+	/* read mostly: where data is and whether lock is needed */
+	struct kfifo fifo;	/* data and size only; indexes are in ring */
+
+	/*
+	 * fifo indexes and data, mapped to user space (mmap); replaced on
+	 * resize (with lock held), lockless readers use it under rcu
+	 */
+	struct shofer_ring *ring;
+
+	/* sharded mode: writers use fifo of their cpu, readers drain all */
+	struct shard __percpu *shards;	/* NULL when not sharded */
+
+	/*
+	 * While there is at most one reader and one writer (open files per
+	 * direction: readers, writers) kfifo needs no locking (spsc is set and
+	 * lock is skipped). Lockless operations run in spsc_srcu read side
+	 * section, holding only lock of their direction (rlock or wlock).
+	 */
+	bool spsc;
+
+	struct mutex lock ____cacheline_aligned_in_smp; /* prevent parallel access */
+	unsigned int next_shard;	/* where next read starts */
+	int readers, writers;
+
+	/* readers wait for data, writers for free space; also for poll */
+	struct wait_queue_head rq ____cacheline_aligned_in_smp;
+	struct wait_queue_head wq ____cacheline_aligned_in_smp;
+
+	/* spsc mode: tasks sharing an open file take turns */
+	struct mutex rlock ____cacheline_aligned_in_smp;
+	struct mutex wlock ____cacheline_aligned_in_smp;
+
+	struct kref ref ____cacheline_aligned_in_smp; /* table, bound devices, operations */
+	atomic_t mapped;	/* mmap-ed areas (ring can't be replaced), -1 in resize */
+	struct mutex resize_lock; /* one resize at a time, taken before lock */
+	int devices;		/* bound devices (with topology_lock) */
+	int id;			/* id to differentiate buffers in prints */
+} ____cacheline_aligned_in_smp;
+
 /* Device driver */
 struct shofer_dev {
 	dev_t dev_no;		/* device number */
-	struct buffer *buffer;	/* Pointer to buffer */
-	struct cdev cdev;	/* Char device structure */
-	struct list_head list;
+	struct buffer __rcu *buffer;	/* Pointer to buffer, can be rebound */
+	struct cdev *cdev;	/* Char device structure */
+	struct device *dev;	/* in shofer class, with buffer_size attribute */
 	int id;			/* id to differentiate drivers in prints */
-
-	struct wait_queue_head rq, wq; /* for poll */
+	struct kref ref;	/* shofers table and open files */
+	int readers, writers;	/* open files, moved with binding */
+	struct rcu_head rcu;	/* freed after rcu lookups (open) are done */
 };
 
 
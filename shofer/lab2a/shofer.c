@@ -18,52 +18,153 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/wait.h>
+#include <linux/srcu.h>
 #include <linux/kfifo.h>
 #include <linux/poll.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/uio.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/capability.h>
+#include <linux/xarray.h>
+#include <linux/device.h>
+#include <linux/version.h>
 
+#include "shofer_uapi.h"
 #include "config.h"
 
+/* splice into pipe through read_iter (generic helper was renamed in 6.5) */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define shofer_splice_read	generic_file_splice_read
+#else
+#define shofer_splice_read	copy_splice_read
+#endif
+
 static int buffer_size = BUFFER_SIZE;	/* Buffer size */
 static int buffer_num = BUFFER_NUM;	/* Number of buffers */
 static int driver_num = DRIVER_NUM;	/* Number of drivers */
+static int driver_max = DRIVER_MAX;	/* Devices that can exist at once */
+static int delay_ms = 0;		/* Latency injection, 0 = off */
+static bool spsc = true;		/* Lockless single reader/writer */
+static bool sharded = false;		/* Per cpu fifos for writers */
 
 /* Some parameters can be given at module load time */
 module_param(buffer_size, int, S_IRUGO);
-MODULE_PARM_DESC(buffer_size, "Buffer size in bytes");
+MODULE_PARM_DESC(buffer_size, "Buffer size in bytes, rounded up to a power of 2");
 module_param(buffer_num, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_num, "Number of buffers to create");
 module_param(driver_num, int, S_IRUGO);
 MODULE_PARM_DESC(driver_num, "Number of devices to create");
+module_param(driver_max, int, S_IRUGO);
+MODULE_PARM_DESC(driver_max, "Max number of devices (control device minor)");
+/* can also be changed at runtime: /sys/module/shofer/parameters/delay_ms */
+module_param(delay_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(delay_ms, "Delay added to each read and write in ms (0=off)");
+module_param(spsc, bool, S_IRUGO);
+MODULE_PARM_DESC(spsc, "Don't lock buffer while it has one reader and one writer");
+module_param(sharded, bool, S_IRUGO);
+MODULE_PARM_DESC(sharded, "Give each buffer a write fifo per cpu");
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
-static LIST_HEAD(buffers_list);
-static LIST_HEAD(shofers_list); /* A list of devices */
+DEFINE_STATIC_SRCU(spsc_srcu); /* for switching buffers out of spsc mode */
+
+/*
+ * Topology (devices, buffers and their binding) can be changed at runtime
+ * through control device; tables and binding are changed with topology_lock.
+ * Operations on a device take a reference to its buffer (buffer_get), so
+ * buffer stays valid even if device is rebound or buffer destroyed.
+ * Buffers are indexed by id, devices by minor; device lookup (open) is
+ * lockless (rcu).
+ */
+static DEFINE_MUTEX(topology_lock);
+static DEFINE_XARRAY(buffers);
+static DEFINE_XARRAY_ALLOC(shofers);
 
 static dev_t Dev_no = 0;
+static struct class *shofer_class;
+static struct cdev control_cdev; /* minor driver_max */
+static bool control_added = false;
+
+/* buffers, cache line aligned (see struct buffer) */
+static struct kmem_cache *buffer_cache;
 
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
 static void buffer_delete(struct buffer *);
+static int buffer_lock(struct buffer *, fmode_t, int *);
+static bool buffer_lockless(struct buffer *);
+static void buffer_unlock(struct buffer *, fmode_t, int);
+static void buffer_users(struct buffer *, int, int);
+static struct buffer *buffer_get(struct shofer_dev *);
+static void buffer_put(struct buffer *);
+static struct buffer *buffer_find(int);
+static int buffer_resize(struct buffer *, size_t);
+static bool rebound(struct shofer_dev *, struct buffer *);
+static int shards_create(struct buffer *, size_t);
+static void shards_delete(struct buffer *);
+static ssize_t buffer_read(struct shofer_dev *, struct buffer *,
+	struct kiocb *, struct iov_iter *);
+static ssize_t buffer_write(struct shofer_dev *, struct buffer *,
+	struct kiocb *, struct iov_iter *);
+static ssize_t sharded_read(struct shofer_dev *, struct buffer *,
+	struct kiocb *, struct iov_iter *);
+static ssize_t sharded_write(struct shofer_dev *, struct buffer *,
+	struct kiocb *, struct iov_iter *);
+static ssize_t fifo_to_iter(struct kfifo *, struct iov_iter *);
+static ssize_t fifo_from_iter(struct kfifo *, struct iov_iter *);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
+static struct shofer_dev *shofer_find(unsigned int);
+static int shofer_bind(struct shofer_dev *, struct buffer *);
 static void cleanup(void);
 static void dump_buffer(char *, struct shofer_dev *, struct buffer *);
 static void simulate_delay(long delay_ms);
+static void ring_fifo(struct buffer *, struct kfifo *);
+static unsigned int buffer_len(struct buffer *);
+static unsigned int buffer_avail(struct buffer *);
 
 static int shofer_open(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static int shofer_release(struct inode *, struct file *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
 static unsigned int shofer_poll(struct file *filp, poll_table *wait);
+static int shofer_mmap(struct file *, struct vm_area_struct *);
+static long shofer_ioctl(struct file *, unsigned int, unsigned long);
+static long control_ioctl(struct file *, unsigned int, unsigned long);
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
-	.read =     shofer_read,
-	.write =    shofer_write,
-	.poll =     shofer_poll
+	.release =  shofer_release,
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter,
+	.splice_read =  shofer_splice_read,
+	.splice_write = iter_file_splice_write,
+	.poll =     shofer_poll,
+	.mmap =     shofer_mmap,
+	.unlocked_ioctl = shofer_ioctl
+};
+
+static struct file_operations control_fops = {
+	.owner =    THIS_MODULE,
+	.unlocked_ioctl = control_ioctl
+};
+
+static void shofer_vm_open(struct vm_area_struct *);
+static void shofer_vm_close(struct vm_area_struct *);
+
+/* mapped ring: buffer can't be freed or resized while it is mapped */
+static const struct vm_operations_struct shofer_vm_ops = {
+	.open =     shofer_vm_open,
+	.close =    shofer_vm_close
 };
 
 /* init module */
@@ -76,43 +177,73 @@ static int __init shofer_module_init(void)
 
 	klog(KERN_NOTICE, "Module started initialization");
 
-	/* get device number(s) */
-	retval = alloc_chrdev_region(&dev_no, 0, driver_num, DRIVER_NAME);
+	/* get device number(s): for devices and control device */
+	driver_max = max(driver_max, driver_num);
+	retval = alloc_chrdev_region(&dev_no, 0, driver_max + 1, DRIVER_NAME);
 	if (retval < 0) {
 		klog(KERN_WARNING, "Can't get major device number");
 		return retval;
 	}
 	Dev_no = dev_no; //remember first
 
-	/* Create and add buffers to the list */
+	/* buffer size must be a power of 2 */
+	if (!is_power_of_2(buffer_size))
+		buffer_size = roundup_pow_of_two(buffer_size);
+
+	buffer_cache = kmem_cache_create("shofer_buffer", sizeof(struct buffer),
+		__alignof__(struct buffer), SLAB_HWCACHE_ALIGN, NULL);
+	if (!buffer_cache) {
+		retval = -ENOMEM;
+		goto no_driver;
+	}
+
+	/* Create and add buffers to the table (ids are 0 to buffer_num-1) */
 	for (i = 0; i < buffer_num; i++) {
 		buffer = buffer_create(buffer_size, &retval);
 		if (!buffer)
 			goto no_driver;
-		list_add_tail(&buffer->list, &buffers_list);
+		retval = xa_insert(&buffers, buffer->id, buffer, GFP_KERNEL);
+		if (retval) {
+			buffer_put(buffer);
+			goto no_driver;
+		}
+	}
+
+	/* class for devices, with tunable attributes in sysfs */
+	shofer_class = class_create(DRIVER_NAME);
+	if (IS_ERR(shofer_class)) {
+		retval = PTR_ERR(shofer_class);
+		shofer_class = NULL;
+		goto no_driver;
 	}
 
-	/* Create and add devices to the list */
+	/* Create and add devices to the table */
+	/* assign buffers to devices in round robin fashion */
 	for (i = 0; i < driver_num; i++) {
-		shofer = shofer_create(dev_no, &shofer_fops, NULL, &retval);
+		buffer = xa_load(&buffers, i % buffer_num);
+		shofer = shofer_create(dev_no, &shofer_fops, buffer, &retval);
 		if (!shofer)
 			goto no_driver;
-		list_add_tail(&shofer->list, &shofers_list);
+		retval = xa_insert(&shofers, MINOR(dev_no), shofer, GFP_KERNEL);
+		if (retval) {
+			shofer_delete(shofer);
+			goto no_driver;
+		}
 		dev_no = MKDEV(MAJOR(dev_no), MINOR(dev_no) + 1);
+		dump_buffer("shofer-initilized", shofer, buffer);
 	}
 
-	/* assign buffers to devices in round robin fashion */
-	buffer = list_first_entry(&buffers_list, struct buffer, list);
-	list_for_each_entry(shofer, &shofers_list, list) {
-		shofer->buffer = buffer;
-		dump_buffer("shofer-initilized", shofer, buffer);
-		if (!list_is_last(&buffer->list, &buffers_list))
-			buffer = list_next_entry(buffer, list);
-		else
-			buffer = list_first_entry(&buffers_list, struct buffer, list);
+	/* control device, for changing topology */
+	cdev_init(&control_cdev, &control_fops);
+	control_cdev.owner = THIS_MODULE;
+	retval = cdev_add(&control_cdev, MKDEV(MAJOR(Dev_no), driver_max), 1);
+	if (retval) {
+		klog(KERN_WARNING, "Error (%d) when adding control device", retval);
+		goto no_driver;
 	}
+	control_added = true;
 
-	klog(KERN_NOTICE, "Module initialized with major=%d", MAJOR(dev_no));
+	klog(KERN_NOTICE, "Module initialized with major=%d", MAJOR(Dev_no));
 
 	return 0;
 
@@ -124,20 +255,28 @@ no_driver:
 
 static void cleanup(void)
 {
-	struct buffer *buffer, *b;
-	struct shofer_dev *shofer, *s;
+	struct buffer *buffer;
+	struct shofer_dev *shofer;
+	unsigned long index;
 
-	list_for_each_entry_safe (shofer, s, &shofers_list, list) {
-		list_del (&shofer->list);
+	if (control_added)
+		cdev_del(&control_cdev);
+	control_added = false;
+
+	xa_for_each(&shofers, index, shofer) {
+		xa_erase(&shofers, index);
 		shofer_delete(shofer);
 	}
-	list_for_each_entry_safe (buffer, b, &buffers_list, list) {
-		list_del (&buffer->list);
-		buffer_delete(buffer);
+	xa_for_each(&buffers, index, buffer) {
+		xa_erase(&buffers, index);
+		buffer_put(buffer); /* devices already released theirs */
 	}
+	if (shofer_class)
+		class_destroy(shofer_class);
+	kmem_cache_destroy(buffer_cache); /* all buffers are released */
 
 	if (Dev_no)
-		unregister_chrdev_region(Dev_no, driver_num);
+		unregister_chrdev_region(Dev_no, driver_max + 1);
 }
 
 /* called when module exit */
@@ -151,24 +290,69 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/*
+ * Create and initialize a single buffer
+ * Ring (control page followed by data) is allocated separately from the
+ * buffer, page aligned, so that it can be mapped into user space.
+ */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
 	static int buffer_id = 0;
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
+	struct buffer *buffer;
+
+	/* as in buffer_resize (kfifo_init would round down) */
+	if (size < 2) {
+		*retval = -EINVAL;
+		return NULL;
+	}
+	size = roundup_pow_of_two(size);
+
+	buffer = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
 	if (!buffer) {
 		*retval = -ENOMEM;
-		klog(KERN_WARNING, "kmalloc failed\n");
+		klog(KERN_WARNING, "kmem_cache_alloc failed\n");
+		return NULL;
+	}
+	buffer->ring = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(size));
+	if (!buffer->ring) {
+		kmem_cache_free(buffer_cache, buffer);
+		*retval = -ENOMEM;
+		klog(KERN_WARNING, "vmalloc_user failed\n");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = kfifo_init(&buffer->fifo, (char *) buffer->ring + PAGE_SIZE,
+		size);
 	if (*retval) {
-		kfree(buffer);
+		vfree(buffer->ring);
+		kmem_cache_free(buffer_cache, buffer);
 		klog(KERN_WARNING, "kfifo_init failed\n");
 		return NULL;
 	}
+	buffer->ring->size = kfifo_size(&buffer->fifo);
+	buffer->ring->data_offset = PAGE_SIZE;
 	buffer->id = buffer_id++;
 	mutex_init(&buffer->lock);
+	mutex_init(&buffer->resize_lock);
+	mutex_init(&buffer->rlock);
+	mutex_init(&buffer->wlock);
+	kref_init(&buffer->ref); /* for buffers table */
+	atomic_set(&buffer->mapped, 0);
+	buffer->devices = 0;
+	buffer->readers = buffer->writers = 0;
+	buffer->spsc = spsc;
+	init_waitqueue_head(&buffer->rq);
+	init_waitqueue_head(&buffer->wq);
+
+	buffer->shards = NULL;
+	if (sharded) {
+		*retval = shards_create(buffer, kfifo_size(&buffer->fifo));
+		if (*retval) {
+			vfree(buffer->ring);
+			kmem_cache_free(buffer_cache, buffer);
+			klog(KERN_WARNING, "shards_create failed\n");
+			return NULL;
+		}
+	}
 
 	*retval = 0;
 
@@ -176,10 +360,287 @@ static struct buffer *buffer_create(size_t size, int *retval)
 }
 static void buffer_delete(struct buffer *buffer)
 {
-	kfree(buffer);
+	shards_delete(buffer);
+	vfree(buffer->ring);
+	kmem_cache_free(buffer_cache, buffer);
+}
+
+/* Get device's current buffer; it stays valid until buffer_put */
+static struct buffer *buffer_get(struct shofer_dev *shofer)
+{
+	struct buffer *buffer;
+
+	/* device's reference is dropped only after rcu grace period */
+	rcu_read_lock();
+	buffer = rcu_dereference(shofer->buffer);
+	kref_get(&buffer->ref);
+	rcu_read_unlock();
+
+	return buffer;
+}
+static void buffer_release(struct kref *ref)
+{
+	struct buffer *buffer = container_of(ref, struct buffer, ref);
+
+	/* files that were bound to it might still be polled (epoll) */
+	wake_up_pollfree(&buffer->rq);
+	wake_up_pollfree(&buffer->wq);
+	synchronize_rcu();
+
+	buffer_delete(buffer);
+}
+static void buffer_put(struct buffer *buffer)
+{
+	kref_put(&buffer->ref, buffer_release);
+}
+
+/* Device was bound to other buffer: operation should use new one */
+static bool rebound(struct shofer_dev *shofer, struct buffer *buffer)
+{
+	return rcu_access_pointer(shofer->buffer) != buffer;
+}
+
+/* Find buffer by id (with topology_lock held) */
+static struct buffer *buffer_find(int id)
+{
+	return xa_load(&buffers, id);
+}
+
+/*
+ * Change buffer size, keeping its data
+ * Lockless operations are stopped (as in buffer_users) and buffer is locked
+ * while data is copied into new ring. Tasks checking buffer state without
+ * lock (wait conditions, poll) could still use old ring, so it is freed
+ * after rcu grace period. Mapped ring can't be replaced: mapped is set to
+ * -1 while resizing, so mmap (which can't take buffer lock, see
+ * shofer_mmap) fails meanwhile.
+ */
+static int buffer_resize(struct buffer *buffer, size_t size)
+{
+	struct shofer_ring *ring, *old;
+	struct kfifo fifo, new;
+	unsigned int len;
+	int retval = 0;
+
+	if (buffer->shards)
+		return -EOPNOTSUPP; /* data is in shards */
+	if (size < 2 || size > BUFFER_SIZE_MAX)
+		return -EINVAL;
+	size = roundup_pow_of_two(size);
+
+	ring = vmalloc_user(PAGE_SIZE + PAGE_ALIGN(size));
+	if (!ring)
+		return -ENOMEM;
+	retval = kfifo_init(&new, (char *) ring + PAGE_SIZE, size);
+	if (retval) {
+		vfree(ring);
+		return retval;
+	}
+
+	mutex_lock(&buffer->resize_lock);
+
+	/* user space has old ring mapped */
+	if (atomic_cmpxchg(&buffer->mapped, 0, -1)) {
+		mutex_unlock(&buffer->resize_lock);
+		vfree(ring);
+		return -EBUSY;
+	}
+
+	mutex_lock(&buffer->lock);
+
+	/* wait for lockless operations to finish; next ones will lock */
+	WRITE_ONCE(buffer->spsc, false);
+	synchronize_srcu(&spsc_srcu);
+
+	ring_fifo(buffer, &fifo);
+	len = kfifo_len(&fifo);
+	if (len > size) {
+		retval = -ENOSPC;
+		goto restore;
+	}
+
+	/* data goes to start of new ring */
+	len = kfifo_out(&fifo, new.kfifo.data, len);
+	ring->in = len;
+	ring->out = 0;
+	ring->size = size;
+	ring->data_offset = PAGE_SIZE;
+
+	/* ring_fifo without lock: new fifo is set before new ring is seen */
+	old = buffer->ring;
+	buffer->fifo = new;
+	smp_store_release(&buffer->ring, ring);
+	ring = old; /* old one is freed */
+
+restore:
+	WRITE_ONCE(buffer->spsc, buffer_lockless(buffer));
+	mutex_unlock(&buffer->lock);
+	atomic_set_release(&buffer->mapped, 0);
+	mutex_unlock(&buffer->resize_lock);
+
+	if (!retval) {
+		synchronize_rcu();
+		/* space and data changed */
+		wake_up_all(&buffer->rq);
+		wake_up_all(&buffer->wq);
+	}
+	vfree(ring);
+
+	return retval;
+}
+
+/* Create a fifo for each cpu, with data on cpu's node */
+static int shards_create(struct buffer *buffer, size_t size)
+{
+	struct shard *shard;
+	void *data;
+	int cpu, retval;
+
+	buffer->shards = alloc_percpu(struct shard); /* zeroed */
+	if (!buffer->shards)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		shard = per_cpu_ptr(buffer->shards, cpu);
+		data = kmalloc_node(size, GFP_KERNEL, cpu_to_node(cpu));
+		if (!data) {
+			shards_delete(buffer);
+			return -ENOMEM;
+		}
+		retval = kfifo_init(&shard->fifo, data, size);
+		if (retval) {
+			kfree(data);
+			shards_delete(buffer);
+			return retval;
+		}
+		mutex_init(&shard->lock);
+	}
+	buffer->next_shard = cpumask_first(cpu_possible_mask);
+
+	return 0;
+}
+static void shards_delete(struct buffer *buffer)
+{
+	int cpu;
+
+	if (!buffer->shards)
+		return;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(buffer->shards, cpu)->fifo.kfifo.data);
+	free_percpu(buffer->shards);
+	buffer->shards = NULL;
+}
+
+/*
+ * Start buffer operation in direction mode (FMODE_READ or FMODE_WRITE):
+ * lock buffer, unless it is used by single reader and single writer, in
+ * which case kfifo can be used without buffer lock. A file can still be
+ * shared (fork, dup, threads), so operations in the same direction are
+ * serialized with direction's lock (not contended by a single user).
+ * *idx is srcu index for lockless operation, -1 when buffer is locked.
+ */
+static int buffer_lock(struct buffer *buffer, fmode_t mode, int *idx)
+{
+	*idx = srcu_read_lock(&spsc_srcu);
+	if (READ_ONCE(buffer->spsc)) {
+		if (!mutex_lock_interruptible(mode & FMODE_READ ?
+				&buffer->rlock : &buffer->wlock))
+			return 0;
+		srcu_read_unlock(&spsc_srcu, *idx);
+		return -ERESTARTSYS;
+	}
+	srcu_read_unlock(&spsc_srcu, *idx);
+
+	*idx = -1;
+	if (mutex_lock_interruptible(&buffer->lock))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+static void buffer_unlock(struct buffer *buffer, fmode_t mode, int idx)
+{
+	if (idx >= 0) {
+		mutex_unlock(mode & FMODE_READ ? &buffer->rlock : &buffer->wlock);
+		srcu_read_unlock(&spsc_srcu, idx);
+	} else {
+		mutex_unlock(&buffer->lock);
+	}
+}
+
+/* Can buffer be used without lock (single reader and single writer) */
+static bool buffer_lockless(struct buffer *buffer)
+{
+	return spsc && buffer->readers <= 1 && buffer->writers <= 1;
+}
+
+/*
+ * Update number of readers and writers (on open/close and when device is
+ * bound to other buffer) and locking mode
+ */
+static void buffer_users(struct buffer *buffer, int readers, int writers)
+{
+	bool lockless;
+
+	mutex_lock(&buffer->lock);
+
+	buffer->readers += readers;
+	buffer->writers += writers;
+
+	lockless = buffer_lockless(buffer);
+	if (buffer->spsc && !lockless) {
+		/* wait for lockless operations to finish; next ones will lock */
+		WRITE_ONCE(buffer->spsc, false);
+		synchronize_srcu(&spsc_srcu);
+	}
+	WRITE_ONCE(buffer->spsc, lockless);
+
+	mutex_unlock(&buffer->lock);
+}
+
+/*
+ * sysfs: size of device's buffer; resizing it affects all devices using it
+ */
+static ssize_t buffer_size_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct buffer *buffer = buffer_get(dev_get_drvdata(dev));
+	unsigned int size = kfifo_size(&buffer->fifo);
+
+	buffer_put(buffer);
+
+	return sysfs_emit(buf, "%u\n", size);
+}
+static ssize_t buffer_size_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct buffer *buffer;
+	unsigned int size;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &size);
+	if (retval)
+		return retval;
+
+	buffer = buffer_get(dev_get_drvdata(dev));
+	retval = buffer_resize(buffer, size);
+	buffer_put(buffer);
+
+	return retval ? retval : count;
 }
+static DEVICE_ATTR_RW(buffer_size);
+
+static struct attribute *shofer_attrs[] = {
+	&dev_attr_buffer_size.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(shofer);
 
-/* Create and initialize a single shofer_dev */
+/*
+ * Create and initialize a single shofer_dev
+ * cdev is allocated separately: it is freed when it is no longer used (also
+ * by open files), while device is freed when its last reference is dropped.
+ */
 static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct file_operations *fops, struct buffer *buffer, int *retval)
 {
@@ -191,116 +652,535 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 		return NULL;
 	}
 	memset(shofer, 0, sizeof(struct shofer_dev));
-	shofer->buffer = buffer;
+	kref_init(&shofer->ref);
+	kref_get(&buffer->ref);
+	buffer->devices++;
+	RCU_INIT_POINTER(shofer->buffer, buffer);
+	shofer->dev_no = dev_no;
+	shofer->id = shofer_id++;
 
-	cdev_init(&shofer->cdev, fops);
-	shofer->cdev.owner = THIS_MODULE;
-	shofer->cdev.ops = fops;
-	*retval = cdev_add (&shofer->cdev, dev_no, 1);
+	shofer->cdev = cdev_alloc();
+	if (!shofer->cdev) {
+		*retval = -ENOMEM;
+		shofer_delete(shofer);
+		return NULL;
+	}
+	shofer->cdev->owner = THIS_MODULE;
+	shofer->cdev->ops = fops;
+	*retval = cdev_add (shofer->cdev, dev_no, 1);
 	if (*retval) {
 		klog(KERN_WARNING, "Error (%d) when adding device", *retval);
-		kfree(shofer);
+		kobject_put(&shofer->cdev->kobj);
+		shofer->cdev = NULL;
+		shofer_delete(shofer);
 		return NULL;
 	}
-	shofer->dev_no = dev_no;
-	shofer->id = shofer_id++;
 
-	/* for poll */
-	init_waitqueue_head(&shofer->rq);
-	init_waitqueue_head(&shofer->wq);
+	/* /sys/class/shofer/shoferN/buffer_size */
+	shofer->dev = device_create_with_groups(shofer_class, NULL, dev_no,
+		shofer, shofer_groups, DRIVER_NAME "%d", MINOR(dev_no));
+	if (IS_ERR(shofer->dev)) {
+		*retval = PTR_ERR(shofer->dev);
+		klog(KERN_WARNING, "Error (%d) when creating device", *retval);
+		shofer->dev = NULL;
+		shofer_delete(shofer);
+		return NULL;
+	}
 
 	return shofer;
 }
+static void shofer_release_ref(struct kref *ref)
+{
+	struct shofer_dev *shofer = container_of(ref, struct shofer_dev, ref);
+
+	buffer_put(rcu_dereference_protected(shofer->buffer, 1));
+	kfree_rcu(shofer, rcu);
+}
+/*
+ * Remove device (already removed from table, with topology_lock held);
+ * open files can still use it until they are closed
+ */
 static void shofer_delete(struct shofer_dev *shofer)
 {
-	cdev_del(&shofer->cdev);
-	kfree(shofer);
+	if (shofer->dev) /* waits for running attribute callbacks */
+		device_destroy(shofer_class, shofer->dev_no);
+	shofer->dev = NULL;
+	if (shofer->cdev)
+		cdev_del(shofer->cdev);
+	shofer->cdev = NULL;
+	rcu_dereference_protected(shofer->buffer, 1)->devices--;
+	kref_put(&shofer->ref, shofer_release_ref);
+}
+
+/* Find device by minor number (with topology_lock held) */
+static struct shofer_dev *shofer_find(unsigned int minor)
+{
+	return xa_load(&shofers, minor);
+}
+
+/*
+ * Bind device to other buffer (with topology_lock held)
+ * Readers and writers of device's open files are moved to new buffer.
+ * Operations already started on old buffer notice the change when they
+ * lock it (or wake up) and restart on the new one.
+ */
+static int shofer_bind(struct shofer_dev *shofer, struct buffer *buffer)
+{
+	struct buffer *old = rcu_dereference_protected(shofer->buffer,
+		lockdep_is_held(&topology_lock));
+
+	if (old == buffer)
+		return 0;
+
+	/* new buffer first: leaves spsc mode if it gets more users */
+	kref_get(&buffer->ref);
+	buffer->devices++;
+	buffer_users(buffer, shofer->readers, shofer->writers);
+
+	/*
+	 * lockless operations on old buffer must finish before users are
+	 * removed from it; ones started later see the new binding
+	 */
+	mutex_lock(&old->lock);
+	rcu_assign_pointer(shofer->buffer, buffer);
+	WRITE_ONCE(old->spsc, false);
+	synchronize_srcu(&spsc_srcu);
+	mutex_unlock(&old->lock);
+	old->devices--;
+	buffer_users(old, -shofer->readers, -shofer->writers);
+
+	/* waiting tasks should move to new buffer */
+	wake_up_all(&old->rq);
+	wake_up_all(&old->wq);
+
+	synchronize_rcu(); /* for buffer_get */
+	buffer_put(old);
+
+	return 0;
 }
 
 /* Open called when a process calls "open" on this device */
 static int shofer_open(struct inode *inode, struct file *filp)
 {
 	struct shofer_dev *shofer; /* device information */
+	int readers = !!(filp->f_mode & FMODE_READ);
+	int writers = !!(filp->f_mode & FMODE_WRITE);
+
+	/* lockless lookup; device may be being removed */
+	rcu_read_lock();
+	shofer = xa_load(&shofers, iminor(inode));
+	if (shofer && !kref_get_unless_zero(&shofer->ref))
+		shofer = NULL;
+	rcu_read_unlock();
+	if (!shofer)
+		return -ENODEV;
 
-	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
+	mutex_lock(&topology_lock);
+
+	if (!shofer->cdev) { /* device was just removed */
+		mutex_unlock(&topology_lock);
+		kref_put(&shofer->ref, shofer_release_ref);
+		return -ENODEV;
+	}
 	filp->private_data = shofer; /* for other methods */
 
+	shofer->readers += readers;
+	shofer->writers += writers;
+	buffer_users(rcu_dereference_protected(shofer->buffer,
+		lockdep_is_held(&topology_lock)), readers, writers);
+
+	mutex_unlock(&topology_lock);
+
 	return 0;
 }
 
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos)
+/* Called when last reference to open file is closed */
+static int shofer_release(struct inode *inode, struct file *filp)
 {
-	ssize_t retval = 0;
 	struct shofer_dev *shofer = filp->private_data;
-	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int copied;
+	int readers = !!(filp->f_mode & FMODE_READ);
+	int writers = !!(filp->f_mode & FMODE_WRITE);
 
-	if (mutex_lock_interruptible(&buffer->lock))
+	mutex_lock(&topology_lock);
+	shofer->readers -= readers;
+	shofer->writers -= writers;
+	buffer_users(rcu_dereference_protected(shofer->buffer,
+		lockdep_is_held(&topology_lock)), -readers, -writers);
+	mutex_unlock(&topology_lock);
+
+	kref_put(&shofer->ref, shofer_release_ref);
+
+	return 0;
+}
+
+/*
+ * read and readv: operation is done on device's current buffer; if device
+ * is bound to other buffer meanwhile (-ESTALE), it is repeated on new one
+ */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
+	struct buffer *buffer;
+	ssize_t retval;
+
+	if (iov_iter_count(to) == 0)
+		return 0;
+
+	do {
+		buffer = buffer_get(shofer);
+		if (buffer->shards)
+			retval = sharded_read(shofer, buffer, iocb, to);
+		else
+			retval = buffer_read(shofer, buffer, iocb, to);
+		buffer_put(buffer);
+	} while (retval == -ESTALE);
+
+	return retval;
+}
+
+/* write and writev, as shofer_read_iter */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct shofer_dev *shofer = iocb->ki_filp->private_data;
+	struct buffer *buffer;
+	ssize_t retval;
+
+	if (iov_iter_count(from) == 0)
+		return 0;
+
+	do {
+		buffer = buffer_get(shofer);
+		if (buffer->shards)
+			retval = sharded_write(shofer, buffer, iocb, from);
+		else
+			retval = buffer_write(shofer, buffer, iocb, from);
+		buffer_put(buffer);
+	} while (retval == -ESTALE);
+
+	return retval;
+}
+
+/* read from buffer: whole iov_iter is filled under single lock */
+static ssize_t buffer_read(struct shofer_dev *shofer, struct buffer *buffer,
+	struct kiocb *iocb, struct iov_iter *to)
+{
+	ssize_t retval = 0;
+	struct file *filp = iocb->ki_filp;
+	struct kfifo fifo;
+	bool waited = false, was_full;
+	int idx;
+
+	if (buffer_lock(buffer, FMODE_READ, &idx))
 		return -ERESTARTSYS;
 
+	while (rebound(shofer, buffer) || buffer_len(buffer) == 0) {
+		buffer_unlock(buffer, FMODE_READ, idx);
+		if (rebound(shofer, buffer))
+			return -ESTALE;
+		/* nothing to read */
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		/* exclusive: one reader is woken for new data, not all */
+		if (wait_event_interruptible_exclusive(buffer->rq,
+				buffer_len(buffer) > 0 || rebound(shofer, buffer)))
+			return -ERESTARTSYS; /* signal */
+		waited = true;
+		if (buffer_lock(buffer, FMODE_READ, &idx))
+			return -ERESTARTSYS;
+	}
+
 	dump_buffer("read-start", shofer, buffer);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		klog(KERN_WARNING, "kfifo_to_user failed\n");
-	else
-		retval = copied;
+	ring_fifo(buffer, &fifo);
+	retval = fifo_to_iter(&fifo, to);
+	if (retval < 0)
+		klog(KERN_WARNING, "fifo_to_iter failed\n");
+	smp_store_release(&buffer->ring->out, fifo.kfifo.out);
 
-	simulate_delay(1000);
+	/*
+	 * was full: checked before unlock, so other readers can't hide it;
+	 * out stored before state is checked (for lockless mode)
+	 */
+	smp_mb();
+	was_full = retval > 0 && buffer_avail(buffer) <= retval;
 
 	dump_buffer("read-end", shofer, buffer);
 
-	mutex_unlock(&buffer->lock);
+	buffer_unlock(buffer, FMODE_READ, idx);
+
+	if (was_full)
+		wake_up_interruptible(&buffer->wq); /* writers and poll */
+	if (retval > 0 && waited && buffer_len(buffer) > 0) /* pass on */
+		wake_up_interruptible(&buffer->rq);
 
-	wake_up_all(&shofer->rq); /* for poll */
+	/* delay outside of critical section, other users can proceed */
+	if (delay_ms > 0)
+		simulate_delay(delay_ms);
 
 	return retval;
 }
 
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos)
+/* write into buffer: whole iov_iter is stored under single lock */
+static ssize_t buffer_write(struct shofer_dev *shofer, struct buffer *buffer,
+	struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
-	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int copied;
+	struct file *filp = iocb->ki_filp;
+	struct kfifo fifo;
+	bool was_empty;
+	int idx;
 
-	if (mutex_lock_interruptible(&buffer->lock))
+	if (buffer_lock(buffer, FMODE_WRITE, &idx))
 		return -ERESTARTSYS;
 
+	while (rebound(shofer, buffer) || buffer_avail(buffer) == 0) {
+		buffer_unlock(buffer, FMODE_WRITE, idx);
+		if (rebound(shofer, buffer))
+			return -ESTALE;
+		/* buffer full */
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(buffer->wq,
+				buffer_avail(buffer) > 0 || rebound(shofer, buffer)))
+			return -ERESTARTSYS; /* signal */
+		if (buffer_lock(buffer, FMODE_WRITE, &idx))
+			return -ERESTARTSYS;
+	}
+
 	dump_buffer("write-start", shofer, buffer);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		klog(KERN_WARNING, "kfifo_from_user failed\n");
-	else
-		retval = copied;
+	ring_fifo(buffer, &fifo);
+	retval = fifo_from_iter(&fifo, from);
+	if (retval < 0)
+		klog(KERN_WARNING, "fifo_from_iter failed\n");
+	smp_store_release(&buffer->ring->in, fifo.kfifo.in);
 
-	simulate_delay(1000);
+	/* was empty: as in buffer_read, checked before unlock */
+	smp_mb();
+	was_empty = retval > 0 && buffer_len(buffer) <= retval;
 
 	dump_buffer("write-end", shofer, buffer);
 
-	mutex_unlock(&buffer->lock);
+	buffer_unlock(buffer, FMODE_WRITE, idx);
+
+	if (was_empty)
+		wake_up_interruptible(&buffer->rq); /* a reader and poll */
+
+	/* delay outside of critical section, other users can proceed */
+	if (delay_ms > 0)
+		simulate_delay(delay_ms);
+
+	return retval;
+}
+
+/* Number of bytes in all shards */
+static unsigned int shards_len(struct buffer *buffer)
+{
+	unsigned int len = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		len += kfifo_len(&per_cpu_ptr(buffer->shards, cpu)->fifo);
+
+	return len;
+}
+
+/* Next shard in round robin order */
+static unsigned int shard_next(unsigned int cpu)
+{
+	cpu = cpumask_next(cpu, cpu_possible_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_possible_mask);
+
+	return cpu;
+}
+
+/*
+ * Read from sharded buffer
+ * Shards are drained in round robin order, each read starting from the
+ * shard after the last one used in previous read. Readers are serialized
+ * with buffer lock, so each shard fifo still has a single consumer.
+ */
+static ssize_t sharded_read(struct shofer_dev *shofer, struct buffer *buffer,
+	struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct shard *shard;
+	unsigned int cpu, n;
+	ssize_t retval = 0, copied;
+	bool waited = false, was_full = false;
+	int idx;
+
+	if (buffer_lock(buffer, FMODE_READ, &idx))
+		return -ERESTARTSYS;
+
+	while (rebound(shofer, buffer) || shards_len(buffer) == 0) {
+		buffer_unlock(buffer, FMODE_READ, idx);
+		if (rebound(shofer, buffer))
+			return -ESTALE;
+		/* nothing to read */
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible_exclusive(buffer->rq,
+				shards_len(buffer) > 0 || rebound(shofer, buffer)))
+			return -ERESTARTSYS; /* signal */
+		waited = true;
+		if (buffer_lock(buffer, FMODE_READ, &idx))
+			return -ERESTARTSYS;
+	}
+
+	cpu = buffer->next_shard;
+	for (n = num_possible_cpus(); n > 0 && iov_iter_count(to); n--) {
+		shard = per_cpu_ptr(buffer->shards, cpu);
+		cpu = shard_next(cpu);
+		if (kfifo_is_empty(&shard->fifo))
+			continue;
+		copied = fifo_to_iter(&shard->fifo, to);
+		if (copied < 0) {
+			klog(KERN_WARNING, "fifo_to_iter failed\n");
+			if (!retval)
+				retval = copied;
+			break;
+		}
+		retval += copied;
+		smp_mb(); /* as in buffer_read */
+		if (copied > 0 && kfifo_avail(&shard->fifo) <= copied)
+			was_full = true;
+	}
+	buffer->next_shard = cpu;
+
+	buffer_unlock(buffer, FMODE_READ, idx);
+
+	if (was_full)
+		wake_up_interruptible(&buffer->wq); /* writers and poll */
+	if (retval > 0 && waited && shards_len(buffer) > 0)
+		wake_up_interruptible(&buffer->rq);
+
+	if (delay_ms > 0)
+		simulate_delay(delay_ms);
+
+	return retval;
+}
+
+/* Write into fifo of current cpu (task may migrate; it is just a hint) */
+static ssize_t sharded_write(struct shofer_dev *shofer, struct buffer *buffer,
+	struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
+	struct shard *shard = per_cpu_ptr(buffer->shards, raw_smp_processor_id());
+	ssize_t retval;
+	bool was_empty;
 
-	wake_up_all(&shofer->wq); /* for poll */
+	if (mutex_lock_interruptible(&shard->lock))
+		return -ERESTARTSYS;
+
+	while (rebound(shofer, buffer) || kfifo_is_full(&shard->fifo)) {
+		mutex_unlock(&shard->lock);
+		if (rebound(shofer, buffer))
+			return -ESTALE;
+		/* shard full */
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(buffer->wq,
+				!kfifo_is_full(&shard->fifo) || rebound(shofer, buffer)))
+			return -ERESTARTSYS; /* signal */
+		if (mutex_lock_interruptible(&shard->lock))
+			return -ERESTARTSYS;
+	}
+
+	retval = fifo_from_iter(&shard->fifo, from);
+	if (retval < 0)
+		klog(KERN_WARNING, "fifo_from_iter failed\n");
+
+	/*
+	 * Writers on other shards run in parallel, so the check is per shard:
+	 * a reader sleeps only when all shards are empty, and then this one
+	 * was empty too (checked under shard lock, as in buffer_write)
+	 */
+	smp_mb();
+	was_empty = retval > 0 && kfifo_len(&shard->fifo) <= retval;
+
+	mutex_unlock(&shard->lock);
+
+	if (was_empty)
+		wake_up_interruptible(&buffer->rq); /* a reader and poll */
+
+	if (delay_ms > 0)
+		simulate_delay(delay_ms);
 
 	return retval;
 }
 
+/*
+ * Copy data from fifo to iterator (as kfifo_to_user, but for any iov_iter)
+ * Returns number of bytes copied or -EFAULT if nothing could be copied.
+ */
+static ssize_t fifo_to_iter(struct kfifo *fifo, struct iov_iter *to)
+{
+	struct __kfifo *f = &fifo->kfifo;
+	unsigned int size = f->mask + 1;
+	unsigned int off = f->out & f->mask;
+	size_t len, l, copied;
+
+	len = min_t(size_t, iov_iter_count(to), f->in - f->out);
+	l = min_t(size_t, len, size - off);
+
+	copied = copy_to_iter((char *) f->data + off, l, to);
+	if (copied == l && len > l)
+		copied += copy_to_iter(f->data, len - l, to);
+
+	/* data must be read before space is given back to producer */
+	smp_store_release(&f->out, f->out + copied);
+
+	return copied || !len ? copied : -EFAULT;
+}
+
+/* Copy data from iterator to fifo (as kfifo_from_user) */
+static ssize_t fifo_from_iter(struct kfifo *fifo, struct iov_iter *from)
+{
+	struct __kfifo *f = &fifo->kfifo;
+	unsigned int size = f->mask + 1;
+	unsigned int off = f->in & f->mask;
+	size_t len, l, copied;
+
+	len = min_t(size_t, iov_iter_count(from), size - (f->in - f->out));
+	l = min_t(size_t, len, size - off);
+
+	copied = copy_from_iter((char *) f->data + off, l, from);
+	if (copied == l && len > l)
+		copied += copy_from_iter(f->data, len - l, from);
+
+	/* data must be stored before consumer can see it */
+	smp_store_release(&f->in, f->in + copied);
+
+	return copied || !len ? copied : -EFAULT;
+}
+
 static unsigned int shofer_poll(struct file *filp, poll_table *wait)
 {
 	struct shofer_dev *shofer = filp->private_data;
-	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int len = kfifo_len(fifo);
-	unsigned int avail = kfifo_avail(fifo);
+	struct buffer *buffer = buffer_get(shofer);
+	struct kfifo fifo;
+	unsigned int len, avail;
 	unsigned int mask = 0;
 
-	poll_wait(filp, &shofer->rq, wait);
-	poll_wait(filp, &shofer->wq, wait);
+	/* wait only on queue(s) for requested events */
+	if (poll_requested_events(wait) & (POLLIN | POLLRDNORM))
+		poll_wait(filp, &buffer->rq, wait);
+	if (poll_requested_events(wait) & (POLLOUT | POLLWRNORM))
+		poll_wait(filp, &buffer->wq, wait);
+
+	if (buffer->shards) {
+		len = shards_len(buffer);
+		avail = kfifo_avail(&raw_cpu_ptr(buffer->shards)->fifo);
+	} else {
+		rcu_read_lock(); /* ring could be replaced (resize) */
+		ring_fifo(buffer, &fifo);
+		len = kfifo_len(&fifo);
+		avail = kfifo_avail(&fifo);
+		rcu_read_unlock();
+	}
+	buffer_put(buffer);
 
 	if (len)
 		mask |= POLLIN | POLLRDNORM; /* readable */
@@ -310,16 +1190,252 @@ static unsigned int shofer_poll(struct file *filp, poll_table *wait)
 	return mask;
 }
 
+/*
+ * Map buffer's ring (control page + data) into user space
+ * Mapping keeps a reference to buffer: it stays mapped even if device is
+ * bound to other buffer later.
+ */
+static int shofer_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer;
+	int retval;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	buffer = buffer_get(shofer);
+	if (buffer->shards) { /* data is in shards, not in ring */
+		buffer_put(buffer);
+		return -EINVAL;
+	}
+
+	/*
+	 * mmap_lock is held here and buffer lock is held across user copies
+	 * (which can fault), so buffer lock can't be taken; ring is pinned
+	 * with mapped instead (negative while buffer_resize replaces it)
+	 */
+	if (!atomic_inc_unless_negative(&buffer->mapped)) {
+		buffer_put(buffer);
+		return -EBUSY;
+	}
+	/* checks size and offset against allocated area */
+	retval = remap_vmalloc_range(vma, buffer->ring, vma->vm_pgoff);
+	if (retval) {
+		atomic_dec(&buffer->mapped);
+		buffer_put(buffer);
+		return retval;
+	}
+	vma->vm_private_data = buffer; /* takes get's reference */
+	vma->vm_ops = &shofer_vm_ops;
+
+	return 0;
+}
+static void shofer_vm_open(struct vm_area_struct *vma)
+{
+	struct buffer *buffer = vma->vm_private_data;
+
+	kref_get(&buffer->ref);
+	atomic_inc(&buffer->mapped);
+}
+static void shofer_vm_close(struct vm_area_struct *vma)
+{
+	struct buffer *buffer = vma->vm_private_data;
+
+	atomic_dec(&buffer->mapped);
+	buffer_put(buffer);
+}
+
+static long shofer_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer;
+
+	switch (cmd) {
+	case SHOFER_IOC_KICK:
+		/* ring was changed by user; let waiters recheck it */
+		buffer = buffer_get(shofer);
+		wake_up_all(&buffer->rq);
+		wake_up_all(&buffer->wq);
+		buffer_put(buffer);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Control device: create/remove buffers and devices, bind device to buffer
+ * and resize buffer. Topology changes are serialized with topology_lock.
+ */
+static long control_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct shofer_ctl ctl;
+	struct shofer_dev *shofer;
+	struct buffer *buffer;
+	u32 minor;
+	int retval = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (_IOC_TYPE(cmd) != SHOFER_IOC_MAGIC || !(_IOC_DIR(cmd) & _IOC_WRITE)
+			|| _IOC_SIZE(cmd) != sizeof(ctl))
+		return -ENOTTY;
+
+	if (copy_from_user(&ctl, (void __user *) arg, sizeof(ctl)))
+		return -EFAULT;
+
+	mutex_lock(&topology_lock);
+
+	switch (cmd) {
+	case SHOFER_IOC_BUFFER_CREATE:
+		if (ctl.size > BUFFER_SIZE_MAX) {
+			retval = -EINVAL;
+			break;
+		}
+		buffer = buffer_create(ctl.size ? ctl.size : buffer_size, &retval);
+		if (!buffer)
+			break;
+		retval = xa_insert(&buffers, buffer->id, buffer, GFP_KERNEL);
+		if (retval) {
+			buffer_put(buffer);
+			break;
+		}
+		ctl.buffer = buffer->id;
+		break;
+
+	case SHOFER_IOC_BUFFER_DESTROY:
+		buffer = buffer_find(ctl.buffer);
+		if (!buffer) {
+			retval = -ENOENT;
+			break;
+		}
+		if (buffer->devices) {
+			retval = -EBUSY;
+			break;
+		}
+		/* mappings and running operations may still hold it */
+		xa_erase(&buffers, buffer->id);
+		buffer_put(buffer);
+		break;
+
+	case SHOFER_IOC_BUFFER_RESIZE:
+		buffer = buffer_find(ctl.buffer);
+		if (!buffer)
+			retval = -ENOENT;
+		else
+			retval = buffer_resize(buffer, ctl.size);
+		break;
+
+	case SHOFER_IOC_DEVICE_CREATE:
+		buffer = buffer_find(ctl.buffer);
+		if (!buffer) {
+			retval = -ENOENT;
+			break;
+		}
+		/* reserve first free minor (entry is NULL until stored) */
+		retval = xa_alloc(&shofers, &minor, NULL,
+			XA_LIMIT(0, driver_max - 1), GFP_KERNEL);
+		if (retval) {
+			retval = retval == -EBUSY ? -ENOSPC : retval;
+			break;
+		}
+		shofer = shofer_create(MKDEV(MAJOR(Dev_no), minor), &shofer_fops,
+			buffer, &retval);
+		if (!shofer) {
+			xa_release(&shofers, minor);
+			break;
+		}
+		xa_store(&shofers, minor, shofer, GFP_KERNEL); /* no allocation */
+		ctl.device = minor;
+		break;
+
+	case SHOFER_IOC_DEVICE_DESTROY:
+		shofer = shofer_find(ctl.device);
+		if (!shofer) {
+			retval = -ENOENT;
+			break;
+		}
+		/* open files keep using it until closed */
+		xa_erase(&shofers, ctl.device);
+		shofer_delete(shofer);
+		break;
+
+	case SHOFER_IOC_DEVICE_BIND:
+		shofer = shofer_find(ctl.device);
+		buffer = buffer_find(ctl.buffer);
+		if (!shofer || !buffer)
+			retval = -ENOENT;
+		else
+			retval = shofer_bind(shofer, buffer);
+		break;
+
+	default:
+		retval = -ENOTTY;
+	}
+
+	mutex_unlock(&topology_lock);
+
+	if (!retval && (_IOC_DIR(cmd) & _IOC_READ)
+			&& copy_to_user((void __user *) arg, &ctl, sizeof(ctl)))
+		retval = -EFAULT;
+
+	return retval;
+}
+
+/*
+ * Get a working copy of buffer's fifo with indexes from the ring
+ * Ring indexes may be changed from user space (mmap) so they are the only
+ * valid ones. Caller stores the index it changed back into ring.
+ */
+static void ring_fifo(struct buffer *buffer, struct kfifo *fifo)
+{
+	struct shofer_ring *ring = smp_load_acquire(&buffer->ring);
+
+	*fifo = buffer->fifo;
+	fifo->kfifo.in = smp_load_acquire(&ring->in);
+	fifo->kfifo.out = smp_load_acquire(&ring->out);
+
+	/* don't trust user: never let kfifo access data outside of ring */
+	if (fifo->kfifo.in - fifo->kfifo.out > kfifo_size(fifo))
+		fifo->kfifo.in = fifo->kfifo.out + kfifo_size(fifo);
+}
+
+/* Number of bytes in buffer (also without lock, e.g. in wait condition) */
+static unsigned int buffer_len(struct buffer *buffer)
+{
+	struct kfifo fifo;
+
+	rcu_read_lock(); /* ring could be replaced (resize) */
+	ring_fifo(buffer, &fifo);
+	rcu_read_unlock();
+	return kfifo_len(&fifo);
+}
+
+/* Free space in buffer */
+static unsigned int buffer_avail(struct buffer *buffer)
+{
+	struct kfifo fifo;
+
+	rcu_read_lock();
+	ring_fifo(buffer, &fifo);
+	rcu_read_unlock();
+	return kfifo_avail(&fifo);
+}
+
 static void dump_buffer(char *prefix, struct shofer_dev *shofer, struct buffer *b)
 {
 	char buf[BUFFER_SIZE];
 	size_t copied;
+	struct kfifo fifo;
 
+	ring_fifo(b, &fifo);
 	memset(buf, 0, BUFFER_SIZE);
-	copied = kfifo_out_peek(&b->fifo, buf, BUFFER_SIZE);
+	copied = kfifo_out_peek(&fifo, buf, BUFFER_SIZE);
 
 	LOG("%s:id=%d,buffer:id=%d:size=%u:contains=%u:buf=%s",
-	prefix, shofer->id, b->id, kfifo_size(&b->fifo), kfifo_len(&b->fifo), buf);
+	prefix, shofer->id, b->id, kfifo_size(&fifo), kfifo_len(&fifo), buf);
 }
 
 static void simulate_delay(long delay_ms)
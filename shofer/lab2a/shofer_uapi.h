@@ -0,0 +1,72 @@
+/*
+ * shofer_uapi.h -- definitions shared with user space programs
+ *
+ * Copyright (C) 2021 Leonardo Jelenkovic
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form.
+ * No warranty is attached.
+ *
+ */
+
+#pragma once
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Ring shared with user space through mmap.
+ *
+ * Mapping starts with this control structure (first page), data follows
+ * at data_offset (size bytes). 'in' and 'out' are free running counters,
+ * as in kfifo: ring holds in - out bytes, byte at position p is stored at
+ * data[p & (size - 1)]. Producer changes only 'in', consumer only 'out'.
+ * Load the other side's counter with acquire and store own with release
+ * semantics (e.g. __atomic_load_n/__atomic_store_n).
+ *
+ * Device read/write use the same ring, so mmap-ed and ordinary users can be
+ * mixed (one producer and one consumer at a time). System call is needed
+ * only to wait for data/space (poll) and, after changing the ring directly,
+ * to wake up the other side (SHOFER_IOC_KICK).
+ */
+struct shofer_ring {
+	__u32 in;		/* producer counter */
+	__u32 out;		/* consumer counter */
+	__u32 size;		/* data size in bytes, power of 2 */
+	__u32 data_offset;	/* where data starts in mapping */
+};
+
+/*
+ * Topology control, ioctls on control device (minor driver_max)
+ *
+ * Devices are identified by minor number, buffers by id. Device can be
+ * bound to other buffer while it is used: open files continue on the new
+ * buffer (data in old buffer stays there). Buffer can be destroyed only when
+ * no device is bound to it; resize keeps data (fails with ENOSPC if it does
+ * not fit, EBUSY while ring is mapped, EOPNOTSUPP for sharded buffers);
+ * meanwhile mmap of buffer's ring fails with EBUSY.
+ */
+struct shofer_ctl {
+	__u32 device;		/* device minor */
+	__u32 buffer;		/* buffer id */
+	__u32 size;		/* buffer size, rounded up to power of 2 */
+	__u32 pad;
+};
+
+#define SHOFER_IOC_MAGIC	'x'
+
+/* wake up tasks waiting on device after ring was changed through mmap */
+#define SHOFER_IOC_KICK		_IO(SHOFER_IOC_MAGIC, 1)
+
+/* create buffer of given size (0 - default); returns its id in buffer */
+#define SHOFER_IOC_BUFFER_CREATE	_IOWR(SHOFER_IOC_MAGIC, 2, struct shofer_ctl)
+/* destroy buffer */
+#define SHOFER_IOC_BUFFER_DESTROY	_IOW(SHOFER_IOC_MAGIC, 3, struct shofer_ctl)
+/* change buffer size */
+#define SHOFER_IOC_BUFFER_RESIZE	_IOW(SHOFER_IOC_MAGIC, 4, struct shofer_ctl)
+/* create device bound to buffer; returns its minor in device */
+#define SHOFER_IOC_DEVICE_CREATE	_IOWR(SHOFER_IOC_MAGIC, 5, struct shofer_ctl)
+/* destroy device (open files can be used until closed) */
+#define SHOFER_IOC_DEVICE_DESTROY	_IOW(SHOFER_IOC_MAGIC, 6, struct shofer_ctl)
+/* bind device to buffer */
+#define SHOFER_IOC_DEVICE_BIND		_IOW(SHOFER_IOC_MAGIC, 7, struct shofer_ctl)
@@ -0,0 +1,86 @@
+/* change shofer devices and buffers using control device ioctls */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+
+#include "../shofer_uapi.h"
+
+#define CONTROL	"/dev/shofer_control"
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s command [arguments]\n", prog);
+	fprintf(stderr, "commands:\n"
+		"\tbuffer-create [SIZE]    create buffer, print its id\n"
+		"\tbuffer-destroy BUF      destroy buffer\n"
+		"\tresize BUF SIZE         change buffer size\n"
+		"\tdevice-create BUF       create device using buffer, print minor\n"
+		"\tdevice-destroy DEV      destroy device with given minor\n"
+		"\tbind DEV BUF            bind device to buffer\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int fd, retval;
+	unsigned long cmd;
+	struct shofer_ctl ctl;
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+	memset(&ctl, 0, sizeof(ctl));
+
+	if (!strcmp(argv[1], "buffer-create")) {
+		cmd = SHOFER_IOC_BUFFER_CREATE;
+		ctl.size = argc > 2 ? atol(argv[2]) : 0;
+	}
+	else if (!strcmp(argv[1], "buffer-destroy") && argc > 2) {
+		cmd = SHOFER_IOC_BUFFER_DESTROY;
+		ctl.buffer = atol(argv[2]);
+	}
+	else if (!strcmp(argv[1], "resize") && argc > 3) {
+		cmd = SHOFER_IOC_BUFFER_RESIZE;
+		ctl.buffer = atol(argv[2]);
+		ctl.size = atol(argv[3]);
+	}
+	else if (!strcmp(argv[1], "device-create") && argc > 2) {
+		cmd = SHOFER_IOC_DEVICE_CREATE;
+		ctl.buffer = atol(argv[2]);
+	}
+	else if (!strcmp(argv[1], "device-destroy") && argc > 2) {
+		cmd = SHOFER_IOC_DEVICE_DESTROY;
+		ctl.device = atol(argv[2]);
+	}
+	else if (!strcmp(argv[1], "bind") && argc > 3) {
+		cmd = SHOFER_IOC_DEVICE_BIND;
+		ctl.device = atol(argv[2]);
+		ctl.buffer = atol(argv[3]);
+	}
+	else {
+		usage(argv[0]);
+		return -1;
+	}
+
+	fd = open(CONTROL, O_RDWR);
+	if (fd == -1) {
+		perror("open failed");
+		return -1;
+	}
+
+	retval = ioctl(fd, cmd, &ctl);
+	if (retval == -1) {
+		perror("ioctl error");
+		return -1;
+	}
+
+	if (cmd == SHOFER_IOC_BUFFER_CREATE)
+		printf("buffer %u\n", ctl.buffer);
+	else if (cmd == SHOFER_IOC_DEVICE_CREATE)
+		printf("device %u\n", ctl.device);
+
+	return 0;
+}
@@ -19,11 +19,39 @@
 #define BUFFER_SIZE	64
 
 #define TIMER_PERIOD	10000 /* 10000 ms */
+#define PUMP_PERIOD_US	1000 /* timer period when pump rate is set */
+#define PUMP_PERIOD_MIN_US	100 /* shortest pump period allowed */
 
-/* Circular buffer */
+#define MAX_STAGES	16
+#define COPY_CHUNK	256 /* read/write copy through stack buffer of this size */
+
+/* Circular buffer; data is allocated separately (kvmalloc) */
 struct buffer {
 	struct kfifo fifo;
 	spinlock_t key;
+	u64 in_total;		/* bytes ever put into buffer */
+	u64 out_total;		/* bytes ever taken from buffer */
+	struct wait_queue_head wait;	/* tasks polling the buffer */
+	struct fasync_struct *async;	/* processes getting SIGIO */
+} ____cacheline_aligned_in_smp;
+
+/* Pipeline stage: pump moving data from one buffer to next */
+struct stage {
+	struct hrtimer timer;
+	spinlock_t lock;	/* one move through stage at a time */
+	struct buffer *in_buff;
+	struct buffer *out_buff;
+	int id;
+	unsigned int mode;	/* SHOFER_PUMP_TIMER or SHOFER_PUMP_IOCTL */
+	unsigned int rate;	/* records/s; 0 - a byte per TIMER_PERIOD */
+	unsigned int record_size;
+	unsigned int period_us;
+	ktime_t last;		/* when credit was last updated */
+	u64 credit;		/* bytes that may be moved (token bucket) */
+	bool active;		/* timer initialized */
+	unsigned int transform;	/* SHOFER_XFORM_* done while moving data */
+	u8 table[256];		/* for SHOFER_XFORM_MAP and _FILTER */
+	u8 *scratch;		/* data being moved, 3 * buffer_size */
 };
 
 /* Device driver */
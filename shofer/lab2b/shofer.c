@@ -13,6 +13,7 @@
 #include <linux/moduleparam.h>
 
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/seq_file.h>
@@ -20,59 +21,134 @@
 #include <linux/kfifo.h>
 #include <linux/log2.h>
 #include <linux/ioctl.h>
-#include <linux/timer.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/crc32.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 12, 0)
+#include <asm/unaligned.h>
+#else
+#include <linux/unaligned.h>
+#endif
 
 #include "config.h"
+#include "shofer_uapi.h"
+
+/* hrtimer_setup (timer and its function in one call) replaced init in 6.13 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+#define shofer_hrtimer_setup(timer, fn, clock, mode) \
+	do { hrtimer_init(timer, clock, mode); (timer)->function = fn; } while (0)
+#else
+#define shofer_hrtimer_setup(timer, fn, clock, mode) \
+	hrtimer_setup(timer, fn, clock, mode)
+#endif
 
 /* Buffer size */
 static int buffer_size = BUFFER_SIZE;
 
+/* Pipeline: stages+1 buffers, each stage moves data to next buffer */
+static int stages = 1;
+
+/* Pump (timer moving data through a stage); defaults for all stages */
+static unsigned int rate = 0;		/* records/s; 0 - a byte per period */
+static unsigned int record_size = 1;	/* bytes in a record */
+static unsigned int pump_period_us = PUMP_PERIOD_US;
+
+static int pump_param_set(const char *, const struct kernel_param *);
+static bool pump_valid(unsigned int, unsigned int);
+static const struct kernel_param_ops pump_param_ops = {
+	.set = pump_param_set,
+	.get = param_get_uint,
+};
+
 /* Some parameters can be given at module load time */
 module_param(buffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_size, "Buffer size in bytes, must be a power of 2");
+module_param(stages, int, S_IRUGO);
+MODULE_PARM_DESC(stages, "Number of pipeline stages between in and out");
+
+/*
+ * pump parameters can also be changed at runtime, in /sys/module/shofer/
+ * (for all stages; single stage is changed with SHOFER_IOC_STAGE_SET)
+ */
+module_param_cb(rate, &pump_param_ops, &rate, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(rate, "Pump rate in records/s (0 - a byte every 10 s)");
+module_param_cb(record_size, &pump_param_ops, &record_size, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(record_size, "Record size in bytes (1 - rate is in bytes/s)");
+module_param_cb(pump_period_us, &pump_param_ops, &pump_period_us,
+	S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(pump_period_us, "Pump period when rate is given (us)");
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
 struct shofer_dev *input_dev = NULL; /* gets data from user into in_buff */
 struct shofer_dev *control_dev = NULL; /* gets commands from user via ioctl */
-struct shofer_dev *output_dev = NULL; /* gets data from in_buff to user */
+struct shofer_dev *output_dev = NULL; /* gets data from out_buff to user */
 struct buffer *in_buff = NULL, *out_buff = NULL;
 static dev_t dev_no = 0;
 
-/* just for passing arguments to timer */
-static struct shofer_timer {
-	struct timer_list timer;
-	struct buffer *in_buff;
-	struct buffer *out_buff;
-} timer;
+/* buffers[0] is in_buff, buffers[stages] is out_buff */
+static struct buffer *buffers[MAX_STAGES + 1];
+static struct kmem_cache *buffer_cache; /* SLAB_HWCACHE_ALIGN, as buffer */
+static struct stage pipeline[MAX_STAGES];
+static DEFINE_MUTEX(pipeline_lock); /* for changing stage configuration */
 
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
+static struct buffer *poll_buffer(struct file *);
 static void buffer_delete(struct buffer *);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
 static void cleanup(void);
 static void dump_buffer(char *prefix, struct buffer *b);
-static void timer_function(struct timer_list *t);
+static void buffer_wake(struct buffer *, int);
+static enum hrtimer_restart timer_function(struct hrtimer *t);
+static int stage_init(struct stage *, int);
+static void stage_stop(struct stage *);
+static unsigned int stage_move(struct stage *, unsigned int, unsigned int,
+	unsigned int *);
+static unsigned int stage_capacity(struct stage *, unsigned int, unsigned int);
+static unsigned int stage_transform(struct stage *, unsigned int,
+	unsigned int, u8 **);
+static ktime_t pump_period(struct stage *);
 
 static int shofer_open_read(struct inode *inode, struct file *filp);
 static int shofer_open_write(struct inode *inode, struct file *filp);
 static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static int shofer_release(struct inode *, struct file *);
+static __poll_t shofer_poll(struct file *, poll_table *);
+static int shofer_fasync(int, struct file *, int);
 static long control_ioctl (struct file *, unsigned int, unsigned long);
+static long control_move(struct shofer_dev *, unsigned int);
+static long control_flush(struct shofer_dev *, unsigned int);
+static long control_peek(struct shofer_dev *, void __user *);
+static long control_stats(struct shofer_dev *, void __user *);
+static long control_stage(struct shofer_dev *, void __user *, bool);
+static long control_transform(struct shofer_dev *, void __user *);
 
 static struct file_operations input_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open_write,
-	.write =    shofer_write
+	.release =  shofer_release,
+	.write =    shofer_write,
+	.poll =     shofer_poll,
+	.fasync =   shofer_fasync
 };
 
 static struct file_operations output_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open_read,
-	.read =     shofer_read
+	.release =  shofer_release,
+	.read =     shofer_read,
+	.poll =     shofer_poll,
+	.fasync =   shofer_fasync
 };
 
 static struct file_operations control_fops = {
@@ -84,7 +160,7 @@ static struct file_operations control_fops = {
 /* init module */
 static int __init shofer_module_init(void)
 {
-	int retval;
+	int retval, i;
 	dev_t devno;
 
 	klog(KERN_NOTICE, "Module started initialization");
@@ -96,14 +172,29 @@ static int __init shofer_module_init(void)
 		return retval;
 	}
 
-	/* create a buffer */
+	/* create buffers */
 	/* buffer size must be a power of 2 */
 	if (!is_power_of_2(buffer_size))
 		buffer_size = roundup_pow_of_two(buffer_size);
-	in_buff = buffer_create(buffer_size, &retval);
-	out_buff = buffer_create(buffer_size, &retval);
-	if (!in_buff || !out_buff)
+	stages = clamp(stages, 1, MAX_STAGES);
+	if (!pump_valid(record_size, pump_period_us)) {
+		klog(KERN_WARNING, "record_size or pump_period_us out of range");
+		retval = -EINVAL;
+		goto no_driver;
+	}
+	buffer_cache = kmem_cache_create("shofer_buffer", sizeof(struct buffer),
+		__alignof__(struct buffer), SLAB_HWCACHE_ALIGN, NULL);
+	if (!buffer_cache) {
+		retval = -ENOMEM;
 		goto no_driver;
+	}
+	for (i = 0; i <= stages; i++) {
+		buffers[i] = buffer_create(buffer_size, &retval);
+		if (!buffers[i])
+			goto no_driver;
+	}
+	in_buff = buffers[0];
+	out_buff = buffers[stages];
 
 	/* create devices */
 	devno = dev_no;
@@ -115,14 +206,16 @@ static int __init shofer_module_init(void)
 	if (!input_dev || !control_dev || !output_dev)
 		goto no_driver;
 
-	/* Create timer */
-	timer.in_buff = in_buff;
-	timer.out_buff = out_buff;
-	timer_setup(&timer.timer, timer_function, 0);
-	timer.timer.expires = jiffies + msecs_to_jiffies(TIMER_PERIOD);
-	add_timer(&timer.timer);
+	/* Create stages, each with its own timer */
+	mutex_lock(&pipeline_lock);
+	for (i = 0; i < stages && !retval; i++)
+		retval = stage_init(&pipeline[i], i);
+	mutex_unlock(&pipeline_lock);
+	if (retval)
+		goto no_driver;
 
-	klog(KERN_NOTICE, "Module initialized with major=%d", MAJOR(devno));
+	klog(KERN_NOTICE, "Module initialized with major=%d, %d stages",
+		MAJOR(devno), stages);
 
 	return 0;
 
@@ -134,20 +227,33 @@ no_driver:
 
 static void cleanup(void)
 {
+	int i;
+
+	/* stop timers first, they use buffers */
+	mutex_lock(&pipeline_lock);
+	for (i = 0; i < MAX_STAGES; i++)
+		if (pipeline[i].active)
+			stage_stop(&pipeline[i]);
+	mutex_unlock(&pipeline_lock);
+
 	if (input_dev)
 		shofer_delete(input_dev);
 	if (control_dev)
 		shofer_delete(control_dev);
 	if (output_dev)
 		shofer_delete(output_dev);
-	if (in_buff)
-		buffer_delete(in_buff);
-	if (out_buff)
-		buffer_delete(out_buff);
+	for (i = 0; i < MAX_STAGES; i++) {
+		kvfree(pipeline[i].scratch);
+		pipeline[i].scratch = NULL;
+	}
+	for (i = 0; i <= MAX_STAGES; i++) {
+		if (buffers[i])
+			buffer_delete(buffers[i]);
+		buffers[i] = NULL;
+	}
+	kmem_cache_destroy(buffer_cache);
 	if (dev_no)
 		unregister_chrdev_region(dev_no, 3);
-
-	del_timer(&timer.timer);
 }
 
 /* called when module exit */
@@ -161,22 +267,30 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/* Create and initialize a single buffer; large data is vmalloc-ed */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
-	if (!buffer) {
+	struct buffer *buffer = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+	void *data = kvmalloc(size, GFP_KERNEL);
+	if (!buffer || !data) {
+		if (buffer)
+			kmem_cache_free(buffer_cache, buffer);
+		kvfree(data);
 		*retval = -ENOMEM;
 		klog(KERN_WARNING, "kmalloc failed\n");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = kfifo_init(&buffer->fifo, data, size);
 	if (*retval) {
-		kfree(buffer);
+		kvfree(data);
+		kmem_cache_free(buffer_cache, buffer);
 		klog(KERN_WARNING, "kfifo_init failed\n");
 		return NULL;
 	}
 	spin_lock_init(&buffer->key);
+	buffer->in_total = buffer->out_total = 0;
+	init_waitqueue_head(&buffer->wait);
+	buffer->async = NULL;
 
 	*retval = 0;
 
@@ -184,7 +298,8 @@ static struct buffer *buffer_create(size_t size, int *retval)
 }
 static void buffer_delete(struct buffer *buffer)
 {
-	kfree(buffer);
+	kvfree(buffer->fifo.kfifo.data);
+	kmem_cache_free(buffer_cache, buffer);
 }
 
 static void dump_buffer(char *prefix, struct buffer *b)
@@ -199,6 +314,20 @@ static void dump_buffer(char *prefix, struct buffer *b)
 		kfifo_size(&b->fifo), kfifo_len(&b->fifo), buf);
 }
 
+/*
+ * Buffer changed: wake up tasks polling it and signal (SIGIO) processes
+ * that asked for it; band is POLL_IN (data added) or POLL_OUT (space freed)
+ * Called from timer (softirq) also.
+ */
+static void buffer_wake(struct buffer *buffer, int band)
+{
+	if (band == POLL_IN)
+		wake_up_interruptible_poll(&buffer->wait, EPOLLIN | EPOLLRDNORM);
+	else
+		wake_up_interruptible_poll(&buffer->wait, EPOLLOUT | EPOLLWRNORM);
+	kill_fasync(&buffer->async, SIGIO, band);
+}
+
 /* Create and initialize a single shofer_dev */
 static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct file_operations *fops, struct buffer *in_buff,
@@ -263,6 +392,47 @@ static int shofer_open_write(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static int shofer_release(struct inode *inode, struct file *filp)
+{
+	/* remove this file from SIGIO notification list */
+	shofer_fasync(-1, filp, 0);
+
+	return 0;
+}
+
+/* buffer that user of this device waits on: in_buff for input_dev */
+static struct buffer *poll_buffer(struct file *filp)
+{
+	struct shofer_dev *shofer = filp->private_data;
+
+	return shofer->out_buff ? shofer->out_buff : shofer->in_buff;
+}
+
+/* input_dev: writable when there is space; output_dev: readable with data */
+static __poll_t shofer_poll(struct file *filp, poll_table *wait)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct buffer *buffer = poll_buffer(filp);
+	__poll_t mask = 0;
+
+	poll_wait(filp, &buffer->wait, wait);
+
+	spin_lock_bh(&buffer->key);
+	if (shofer->out_buff && kfifo_len(&buffer->fifo) > 0)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (shofer->in_buff && kfifo_avail(&buffer->fifo) > 0)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	spin_unlock_bh(&buffer->key);
+
+	return mask;
+}
+
+/* SIGIO when data arrives into out_buff or space is freed in in_buff */
+static int shofer_fasync(int fd, struct file *filp, int mode)
+{
+	return fasync_helper(fd, filp, mode, &poll_buffer(filp)->async);
+}
+
 /* output_dev only */
 static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	loff_t *f_pos)
@@ -271,21 +441,37 @@ static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
 	struct shofer_dev *shofer = filp->private_data;
 	struct buffer *out_buff = shofer->out_buff;
 	struct kfifo *fifo = &out_buff->fifo;
-	unsigned int copied;
+	unsigned int copied, chunk;
+	char buf[COPY_CHUNK];
 
-	spin_lock(&out_buff->key);
+	/*
+	 * copy to user can sleep (page fault): not under spinlock; data is
+	 * taken into kernel buffer first, a chunk at a time
+	 */
+	count = min_t(size_t, count, buffer_size);
+	while (retval < count) {
+		chunk = min_t(size_t, count - retval, COPY_CHUNK);
 
-	dump_buffer("out_dev-start:out_buff:", out_buff);
+		/* _bh: timer (softirq) also uses the lock */
+		spin_lock_bh(&out_buff->key);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		klog(KERN_WARNING, "kfifo_to_user failed\n");
-	else
-		retval = copied;
+		dump_buffer("out_dev-start:out_buff:", out_buff);
+
+		copied = kfifo_out(fifo, buf, chunk);
+		out_buff->out_total += copied;
 
-	dump_buffer("out_dev-end:out_buff:", out_buff);
+		dump_buffer("out_dev-end:out_buff:", out_buff);
 
-	spin_unlock(&out_buff->key);
+		spin_unlock_bh(&out_buff->key);
+
+		if (copy_to_user(ubuf + retval, buf, copied)) {
+			klog(KERN_WARNING, "copy_to_user failed\n");
+			return retval ? retval : -EFAULT;
+		}
+		retval += copied;
+		if (copied < chunk) /* buffer is empty */
+			break;
+	}
 
 	return retval;
 }
@@ -300,121 +486,563 @@ static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
 	struct shofer_dev *shofer = filp->private_data;
 	struct buffer *in_buff = shofer->in_buff;
 	struct kfifo *fifo = &in_buff->fifo;
-	unsigned int copied;
+	unsigned int copied, chunk;
+	char buf[COPY_CHUNK];
+
+	/* copy from user first, without spinlock (as in read) */
+	count = min_t(size_t, count, buffer_size);
+	while (retval < count) {
+		chunk = min_t(size_t, count - retval, COPY_CHUNK);
+		if (copy_from_user(buf, ubuf + retval, chunk)) {
+			klog(KERN_WARNING, "copy_from_user failed\n");
+			return retval ? retval : -EFAULT;
+		}
 
-	spin_lock(&in_buff->key);
+		spin_lock_bh(&in_buff->key);
 
-	dump_buffer("in_dev-start:in_buff:", in_buff);
+		dump_buffer("in_dev-start:in_buff:", in_buff);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval) {
-		klog(KERN_WARNING, "kfifo_from_user failed\n");
-	} else {
-		retval = copied;
-	}
+		copied = kfifo_in(fifo, buf, chunk);
+		in_buff->in_total += copied;
 
-	dump_buffer("in_dev-end:in_buff:", in_buff);
+		dump_buffer("in_dev-end:in_buff:", in_buff);
 
-	spin_unlock(&in_buff->key);
+		spin_unlock_bh(&in_buff->key);
+
+		retval += copied;
+		if (copied < chunk) /* buffer is full */
+			break;
+	}
 
 	return retval;
 }
 
 static long control_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	ssize_t retval = 0;
 	struct shofer_dev *shofer = filp->private_data;
+	void __user *uarg = (void __user *) arg;
+	__u32 n;
+
+	switch (cmd) {
+	case SHOFER_IOC_MOVE:
+		if (get_user(n, (__u32 __user *) uarg))
+			return -EFAULT;
+		return control_move(shofer, n);
+
+	case SHOFER_IOC_FLUSH:
+		if (get_user(n, (__u32 __user *) uarg))
+			return -EFAULT;
+		return control_flush(shofer, n);
+
+	case SHOFER_IOC_PEEK:
+		return control_peek(shofer, uarg);
+
+	case SHOFER_IOC_STATS:
+		return control_stats(shofer, uarg);
+
+	case SHOFER_IOC_STAGE_GET:
+		return control_stage(shofer, uarg, false);
+
+	case SHOFER_IOC_STAGE_SET:
+		return control_stage(shofer, uarg, true);
+
+	case SHOFER_IOC_TRANSFORM:
+		return control_transform(shofer, uarg);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Move up to n bytes through each stage, from first to last
+ * (what is moved into out_buff is returned)
+ */
+static long control_move(struct shofer_dev *shofer, unsigned int n)
+{
+	unsigned int moved = 0;
+	int i;
+
+	if (!n)
+		return -EINVAL;
+
+	for (i = 0; i < stages; i++)
+		stage_move(&pipeline[i], n, 1, &moved);
+
+	LOG("control_ioctl moved %u bytes into out_buff", moved);
+
+	return moved;
+}
+
+/* discard data from given buffers; returns number of discarded bytes */
+static long control_flush(struct shofer_dev *shofer, unsigned int which)
+{
+	struct buffer *b[2] = {shofer->in_buff, shofer->out_buff};
+	long retval = 0;
+	unsigned int len;
+	int i;
+
+	if (!which || (which & ~(SHOFER_IN | SHOFER_OUT)))
+		return -EINVAL;
+
+	for (i = 0; i < 2; i++) {
+		if (!(which & (1 << i)))
+			continue;
+		spin_lock_bh(&b[i]->key);
+		len = kfifo_len(&b[i]->fifo);
+		kfifo_reset_out(&b[i]->fifo);
+		b[i]->out_total += len; /* discarded data is taken too */
+		retval += len;
+		spin_unlock_bh(&b[i]->key);
+		buffer_wake(b[i], POLL_OUT);
+	}
+
+	return retval;
+}
+
+/* copy data from buffer, without removing it */
+static long control_peek(struct shofer_dev *shofer, void __user *uarg)
+{
+	struct shofer_peek peek;
+	struct buffer *buffer;
+	unsigned int copied;
+	char *buf;
+
+	if (copy_from_user(&peek, uarg, sizeof(peek)))
+		return -EFAULT;
+
+	if (peek.which == SHOFER_IN)
+		buffer = shofer->in_buff;
+	else if (peek.which == SHOFER_OUT)
+		buffer = shofer->out_buff;
+	else
+		return -EINVAL;
+
+	if (peek.len > buffer_size)
+		peek.len = buffer_size;
+
+	/* can't copy to user while holding spinlock (page fault could sleep) */
+	buf = kvmalloc(peek.len, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	spin_lock_bh(&buffer->key);
+	copied = kfifo_out_peek(&buffer->fifo, buf, peek.len);
+	spin_unlock_bh(&buffer->key);
+
+	if (copy_to_user(u64_to_user_ptr(peek.buf), buf, copied)) {
+		kvfree(buf);
+		return -EFAULT;
+	}
+	kvfree(buf);
+
+	return copied;
+}
+
+static long control_stats(struct shofer_dev *shofer, void __user *uarg)
+{
 	struct buffer *in_buff = shofer->in_buff;
 	struct buffer *out_buff = shofer->out_buff;
-	struct kfifo *fifo_in = &in_buff->fifo;
-	struct kfifo *fifo_out = &out_buff->fifo;
-	char c;
-	int got;
-	int i;
+	struct shofer_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.size = buffer_size;
+
+	spin_lock_bh(&in_buff->key);
+	stats.in_len = kfifo_len(&in_buff->fifo);
+	stats.written = in_buff->in_total;
+	stats.moved = in_buff->out_total;
+	spin_unlock_bh(&in_buff->key);
 
-	if (!cmd)
+	spin_lock_bh(&out_buff->key);
+	stats.out_len = kfifo_len(&out_buff->fifo);
+	stats.read = out_buff->out_total;
+	spin_unlock_bh(&out_buff->key);
+
+	if (copy_to_user(uarg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* get or set stage configuration; get also returns stage state */
+static long control_stage(struct shofer_dev *shofer, void __user *uarg,
+	bool set)
+{
+	struct shofer_stage conf;
+	struct stage *stage;
+
+	if (copy_from_user(&conf, uarg, sizeof(conf)))
+		return -EFAULT;
+	if (conf.stage >= stages)
 		return -EINVAL;
+	stage = &pipeline[conf.stage];
+
+	if (set) {
+		if (conf.mode != SHOFER_PUMP_TIMER && conf.mode != SHOFER_PUMP_IOCTL)
+			return -EINVAL;
+		if (!conf.period_us)
+			conf.period_us = PUMP_PERIOD_US;
+		if (!pump_valid(conf.record_size, conf.period_us))
+			return -EINVAL;
+
+		mutex_lock(&pipeline_lock);
+		WRITE_ONCE(stage->rate, conf.rate);
+		WRITE_ONCE(stage->record_size, conf.record_size);
+		WRITE_ONCE(stage->period_us, conf.period_us);
+		WRITE_ONCE(stage->mode, conf.mode);
+		if (conf.mode == SHOFER_PUMP_TIMER)
+			hrtimer_start(&stage->timer, 0, HRTIMER_MODE_REL_SOFT);
+		else
+			hrtimer_cancel(&stage->timer);
+		mutex_unlock(&pipeline_lock);
+
+		return 0;
+	}
 
-	/* copy cmd bytes from in_buff to out_buff */
-	/* todo (similar to timer) - done */
-
-	/* get locks on both buffers */
-	spin_lock(&out_buff->key);
-	spin_lock(&in_buff->key);
-
-	dump_buffer("control_ioctl-start:in_buff", in_buff);
-	dump_buffer("control_ioctl-start:out_buff", out_buff);
-
-	for (i = 0; i < cmd; i++) {
-		if (kfifo_len(fifo_in) > 0 && kfifo_avail(fifo_out) > 0) {
-			got = kfifo_get(fifo_in, &c);
-			retval += got;
-			if (got > 0) {
-				got = kfifo_put(fifo_out, c);
-				if (got) {
-					LOG("control_ioctl moved '%c' from in to out, retval is %ld", c, retval);
-				} else {
-					klog(KERN_WARNING, "kfifo_put failed\n");
-				}
-			} else {
-				klog(KERN_WARNING, "kfifo_get failed\n");
-			}
-		} else {
-			LOG("control_ioctl empty buffer");
-			break;
-		}
+	conf.mode = READ_ONCE(stage->mode);
+	conf.transform = READ_ONCE(stage->transform);
+	conf.rate = READ_ONCE(stage->rate);
+	conf.record_size = READ_ONCE(stage->record_size);
+	conf.period_us = READ_ONCE(stage->period_us);
+	conf.stages = stages;
+
+	/* queue depth: how much waits for stage, and space it can move into */
+	spin_lock_bh(&stage->in_buff->key);
+	conf.in_len = kfifo_len(&stage->in_buff->fifo);
+	conf.moved = stage->in_buff->out_total;
+	spin_unlock_bh(&stage->in_buff->key);
+
+	spin_lock_bh(&stage->out_buff->key);
+	conf.out_avail = kfifo_avail(&stage->out_buff->fifo);
+	conf.produced = stage->out_buff->in_total;
+	spin_unlock_bh(&stage->out_buff->key);
+
+	if (copy_to_user(uarg, &conf, sizeof(conf)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* select transformation done by stage while moving data */
+static long control_transform(struct shofer_dev *shofer, void __user *uarg)
+{
+	struct shofer_transform *xf;
+	struct stage *stage;
+
+	/* too big for stack */
+	xf = memdup_user(uarg, sizeof(*xf));
+	if (IS_ERR(xf))
+		return PTR_ERR(xf);
+
+	if (xf->stage >= stages || xf->type > SHOFER_XFORM_RLE) {
+		kfree(xf);
+		return -EINVAL;
 	}
+	stage = &pipeline[xf->stage];
 
-	dump_buffer("control_ioctl-end:in_buff", in_buff);
-	dump_buffer("control_ioctl-end:out_buff", out_buff);
+	/* stage_move uses transformation with stage lock held */
+	spin_lock_bh(&stage->lock);
+	stage->transform = xf->type;
+	memcpy(stage->table, xf->table, sizeof(stage->table));
+	spin_unlock_bh(&stage->lock);
 
-	spin_unlock(&in_buff->key);
-	spin_unlock(&out_buff->key);
+	kfree(xf);
 
-	return retval;
+	return 0;
 }
 
-static void timer_function(struct timer_list *t)
+/* Initialize stage i, which moves data from buffers[i] to buffers[i+1] */
+static int stage_init(struct stage *stage, int i)
 {
-	struct shofer_timer *timer = container_of(t, struct shofer_timer, timer);
-	struct buffer *in_buff = timer->in_buff, *out_buff = timer->out_buff;
+	/* input chunk and transformed chunk (RLE can double the size) */
+	stage->scratch = kvmalloc(3 * buffer_size, GFP_KERNEL);
+	if (!stage->scratch) {
+		klog(KERN_WARNING, "kmalloc failed\n");
+		return -ENOMEM;
+	}
+	spin_lock_init(&stage->lock);
+
+	stage->id = i;
+	stage->in_buff = buffers[i];
+	stage->out_buff = buffers[i + 1];
+	stage->mode = SHOFER_PUMP_TIMER;
+	stage->rate = rate;
+	stage->record_size = record_size;
+	stage->period_us = pump_period_us;
+	stage->last = ktime_get();
+	stage->credit = 0;
+
+	/* timer in softirq (as timer_list), not in hardirq */
+	shofer_hrtimer_setup(&stage->timer, timer_function, CLOCK_MONOTONIC,
+		HRTIMER_MODE_REL_SOFT);
+	hrtimer_start(&stage->timer, pump_period(stage), HRTIMER_MODE_REL_SOFT);
+	stage->active = true;
+
+	return 0;
+}
+
+static void stage_stop(struct stage *stage)
+{
+	WRITE_ONCE(stage->mode, SHOFER_PUMP_IOCTL); /* timer won't restart */
+	hrtimer_cancel(&stage->timer);
+	stage->active = false;
+}
+
+/*
+ * Move up to n bytes (only whole records of rs bytes) through stage
+ * Buffers are never locked together: space in out_buff is checked, data is
+ * taken from in_buff into stage's scratch buffer (under in_buff lock only),
+ * transformed without buffer locks and put into out_buff (under its lock
+ * only). Stage lock keeps timer and ioctl on the same stage from running
+ * in parallel; since stage is the only one that puts data into out_buff,
+ * space checked at start can only grow.
+ * If there isn't enough space in next buffer, data stays in stage's input
+ * buffer; when it fills, writes into it fail - back-pressure is propagated
+ * stage by stage to input_dev.
+ * Locks are also used from timer (softirq), hence _bh variants.
+ * Returns bytes taken from in_buff; bytes put into out_buff (which differ
+ * with transformation) are stored into *moved.
+ */
+static unsigned int stage_move(struct stage *stage, unsigned int n,
+	unsigned int rs, unsigned int *moved)
+{
+	struct buffer *in_buff = stage->in_buff, *out_buff = stage->out_buff;
 	struct kfifo *fifo_in = &in_buff->fifo;
 	struct kfifo *fifo_out = &out_buff->fifo;
-	char c;
-	int got;
-
-	/* get locks on both buffers */
-	spin_lock(&out_buff->key);
-	spin_lock(&in_buff->key);
-
-	dump_buffer("timer-start:in_buff", in_buff);
-	dump_buffer("timer-start:out_buff", out_buff);
-
-	if (kfifo_len(fifo_in) > 0 && kfifo_avail(fifo_out) > 0) {
-		got = kfifo_get(fifo_in, &c);
-		if (got > 0) {
-			got = kfifo_put(fifo_out, c);
-			if (got)
-				LOG("timer moved '%c' from in to out", c);
-			else /* should't happen! */
-				klog(KERN_WARNING, "kfifo_put failed\n");
+	unsigned int avail, m = 0;
+	u8 *out;
+
+	spin_lock_bh(&stage->lock);
+
+	if (stage->transform == SHOFER_XFORM_CRC)
+		rs = stage->record_size; /* checksum is per record */
+
+	spin_lock_bh(&out_buff->key);
+	avail = kfifo_avail(fifo_out);
+	spin_unlock_bh(&out_buff->key);
+
+	spin_lock_bh(&in_buff->key);
+	dump_buffer("stage-start:in_buff", in_buff);
+	n = min_t(unsigned int, n, kfifo_len(fifo_in));
+	n = min_t(unsigned int, n, stage_capacity(stage, avail, rs));
+	n -= n % rs;
+	n = kfifo_out(fifo_in, stage->scratch, n);
+	in_buff->out_total += n;
+	dump_buffer("stage-end:in_buff", in_buff);
+	spin_unlock_bh(&in_buff->key);
+
+	if (n > 0) {
+		buffer_wake(in_buff, POLL_OUT);
+
+		m = stage_transform(stage, n, rs, &out);
+
+		spin_lock_bh(&out_buff->key);
+		dump_buffer("stage-start:out_buff", out_buff);
+		kfifo_in(fifo_out, out, m);
+		out_buff->in_total += m;
+		dump_buffer("stage-end:out_buff", out_buff);
+		spin_unlock_bh(&out_buff->key);
+
+		if (m > 0)
+			buffer_wake(out_buff, POLL_IN);
+	}
+
+	spin_unlock_bh(&stage->lock);
+
+	*moved = m;
+
+	return n;
+}
+
+/* How much input can be moved so that its transformation fits into avail */
+static unsigned int stage_capacity(struct stage *stage, unsigned int avail,
+	unsigned int rs)
+{
+	switch (stage->transform) {
+	case SHOFER_XFORM_CRC: /* each record gets 4 bytes of crc */
+		return avail / (rs + 4) * rs;
+	case SHOFER_XFORM_RLE: /* worst case: (1, byte) for each byte */
+		return avail / 2;
+	default:
+		return avail;
+	}
+}
+
+/*
+ * Transform n bytes taken into stage's scratch buffer
+ * Whole chunk is transformed at once (data is already in cache) into other
+ * part of scratch buffer; result is returned with 'out' (without
+ * transformation it is the input itself). Output fits into space checked
+ * with stage_capacity; for SHOFER_XFORM_CRC n is multiple of record size rs.
+ * Returns size of output.
+ */
+static unsigned int stage_transform(struct stage *stage, unsigned int n,
+	unsigned int rs, u8 **out_p)
+{
+	u8 *in = stage->scratch, *out = in + buffer_size;
+	unsigned int i, j, m = 0;
+	u32 crc;
+
+	*out_p = out;
+
+	switch (stage->transform) {
+	case SHOFER_XFORM_NONE:
+		*out_p = in;
+		m = n;
+		break;
+
+	case SHOFER_XFORM_MAP: /* replace each byte using table */
+		for (i = 0; i < n; i++)
+			out[i] = stage->table[in[i]];
+		m = n;
+		break;
+
+	case SHOFER_XFORM_FILTER: /* keep only bytes with nonzero table entry */
+		for (i = 0; i < n; i++)
+			if (stage->table[in[i]])
+				out[m++] = in[i];
+		break;
+
+	case SHOFER_XFORM_CRC: /* append crc32 (little endian) to each record */
+		for (i = 0; i < n; i += rs) {
+			memcpy(out + m, in + i, rs);
+			m += rs;
+			crc = crc32_le(~0, in + i, rs) ^ ~0;
+			put_unaligned_le32(crc, out + m);
+			m += 4;
 		}
-		else { /* should't happen! */
-			klog(KERN_WARNING, "kfifo_get failed\n");
+		break;
+
+	case SHOFER_XFORM_RLE: /* (count, byte) pairs, count up to 255 */
+		for (i = 0; i < n; i = j) {
+			for (j = i + 1; j < n && j - i < 255 && in[j] == in[i]; j++)
+				;
+			out[m++] = j - i;
+			out[m++] = in[i];
 		}
+		break;
+	}
+
+	return m;
+}
+
+/* Time until next pump tick */
+static ktime_t pump_period(struct stage *stage)
+{
+	if (READ_ONCE(stage->rate))
+		return ns_to_ktime((u64) READ_ONCE(stage->period_us)
+			* NSEC_PER_USEC);
+	else
+		return ms_to_ktime(TIMER_PERIOD);
+}
+
+/* How many bytes pump may move now (token bucket) */
+static unsigned int pump_credit(struct stage *stage)
+{
+	unsigned int r = READ_ONCE(stage->rate);
+	unsigned int rs = READ_ONCE(stage->record_size);
+	ktime_t now = ktime_get();
+	u64 elapsed = ktime_to_ns(ktime_sub(now, stage->last));
+	u64 records;
+
+	if (!r) {
+		stage->last = now;
+		return 1; /* original behaviour: one byte per TIMER_PERIOD */
+	}
+
+	/* records earned since last; the remaining fraction is kept for later */
+	records = mul_u64_u32_div(elapsed, r, NSEC_PER_SEC);
+	if (records >= buffer_size) {
+		records = buffer_size;
+		stage->last = now;
 	}
 	else {
-		LOG("timer: nothing in input buffer");
-		//for test: put '#' in output buffer
-		// got = kfifo_put(fifo_out, '#');
+		stage->last = ktime_add_ns(stage->last,
+			div_u64(records * NSEC_PER_SEC, r));
+	}
+
+	/* what was not used (no data or no space) is kept, up to buffer_size */
+	stage->credit = min_t(u64, stage->credit + records * rs, buffer_size);
+
+	/* only whole records are moved */
+	return stage->credit - (u32) stage->credit % rs;
+}
+
+/*
+ * Record (with crc appended) must fit into buffer, or pump could never move
+ * it (credit is limited to buffer_size); period is limited since timer runs
+ * in softirq
+ */
+static bool pump_valid(unsigned int record_size, unsigned int period_us)
+{
+	return record_size >= 1 && (u64) record_size + 4 <= buffer_size &&
+		period_us >= PUMP_PERIOD_MIN_US;
+}
+
+/*
+ * Changing pump parameters: set them for all stages and restart timers
+ * so new values are used now
+ * (at load time, buffer_size must be given before record_size)
+ */
+static int pump_param_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int value;
+	struct stage *stage;
+	int retval, i;
+
+	retval = kstrtouint(val, 0, &value);
+	if (retval)
+		return retval;
+	if (kp->arg == &record_size && !pump_valid(value, pump_period_us))
+		return -EINVAL;
+	if (kp->arg == &pump_period_us && !pump_valid(record_size, value))
+		return -EINVAL;
+	*(unsigned int *) kp->arg = value;
+
+	mutex_lock(&pipeline_lock);
+	for (i = 0; i < MAX_STAGES; i++) {
+		stage = &pipeline[i];
+		if (!stage->active)
+			continue;
+		WRITE_ONCE(stage->rate, rate);
+		WRITE_ONCE(stage->record_size, record_size);
+		WRITE_ONCE(stage->period_us, pump_period_us);
+		if (stage->mode == SHOFER_PUMP_TIMER)
+			hrtimer_start(&stage->timer, 0, HRTIMER_MODE_REL_SOFT);
 	}
+	mutex_unlock(&pipeline_lock);
+
+	return 0;
+}
+
+static enum hrtimer_restart timer_function(struct hrtimer *t)
+{
+	struct stage *stage = container_of(t, struct stage, timer);
+	unsigned int n, moved, rs = 1;
+
+	if (READ_ONCE(stage->mode) != SHOFER_PUMP_TIMER)
+		return HRTIMER_NORESTART; /* stage is moved on demand only */
+
+	/* whole records in a single chunk */
+	if (READ_ONCE(stage->rate))
+		rs = READ_ONCE(stage->record_size);
+	n = stage_move(stage, pump_credit(stage), rs, &moved);
 
-	dump_buffer("timer-end:in_buff", in_buff);
-	dump_buffer("timer-end:out_buff", out_buff);
+	if (n > 0) {
+		if (stage->credit >= n)
+			stage->credit -= n;
+		LOG("timer %d moved %u bytes (%u out)", stage->id, n, moved);
+	}
+	else {
+		LOG("timer %d: nothing moved", stage->id);
+	}
 
-	spin_unlock(&in_buff->key);
-	spin_unlock(&out_buff->key);
+	/*
+	 * reschedule timer for period; with hrtimer_start (not forward) since
+	 * parameter change could restart it in parallel
+	 */
+	hrtimer_start(t, pump_period(stage), HRTIMER_MODE_REL_SOFT);
 
-	/* reschedule timer for period */
-	mod_timer(t, jiffies + msecs_to_jiffies(TIMER_PERIOD));
+	return HRTIMER_NORESTART;
 }
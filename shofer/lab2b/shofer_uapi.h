@@ -0,0 +1,88 @@
+/*
+ * shofer_uapi.h -- definitions shared with user space programs
+ *
+ * Copyright (C) 2021 Leonardo Jelenkovic
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form.
+ * No warranty is attached.
+ *
+ */
+
+#pragma once
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* which buffer: input (in_buff) or output (out_buff) */
+#define SHOFER_IN	1
+#define SHOFER_OUT	2
+
+/* for SHOFER_IOC_PEEK */
+struct shofer_peek {
+	__u64 buf;		/* where to copy data (user pointer) */
+	__u32 len;		/* buf size */
+	__u32 which;		/* SHOFER_IN or SHOFER_OUT */
+};
+
+/* for SHOFER_IOC_STATS */
+struct shofer_stats {
+	__u32 size;		/* buffer size */
+	__u32 in_len;		/* bytes in in_buff */
+	__u32 out_len;		/* bytes in out_buff */
+	__u32 pad;
+	__u64 written;		/* total bytes written into in_buff */
+	__u64 moved;		/* total bytes moved from in_buff to out_buff */
+	__u64 read;		/* total bytes read from out_buff */
+};
+
+/* for SHOFER_IOC_STAGE_GET/SET */
+struct shofer_stage {
+	__u32 stage;		/* stage index, 0 - first (from in_buff) */
+	__u32 mode;		/* SHOFER_PUMP_TIMER or SHOFER_PUMP_IOCTL */
+	__u32 rate;		/* records/s; 0 - a byte every 10 s */
+	__u32 record_size;	/* bytes in a record, 1 to buffer size - 4 */
+	__u32 period_us;	/* timer period when rate is set, >= 100 */
+	__u32 stages;		/* get: number of stages */
+	__u32 in_len;		/* get: bytes waiting for stage */
+	__u32 out_avail;	/* get: free space in stage's output buffer */
+	__u64 moved;		/* get: total bytes moved by stage */
+	__u64 produced;		/* get: total bytes put in output buffer */
+	__u32 transform;	/* get: SHOFER_XFORM_* */
+	__u32 pad;
+};
+
+/* stage pump modes */
+#define SHOFER_PUMP_TIMER	0	/* periodically, with timer */
+#define SHOFER_PUMP_IOCTL	1	/* on demand, with SHOFER_IOC_MOVE */
+
+/* stage transformations (data is transformed while it is moved) */
+#define SHOFER_XFORM_NONE	0	/* data is copied */
+#define SHOFER_XFORM_MAP	1	/* byte b is replaced with table[b] */
+#define SHOFER_XFORM_FILTER	2	/* byte b is dropped if table[b] == 0 */
+#define SHOFER_XFORM_CRC	3	/* crc32 (le) appended to each record */
+#define SHOFER_XFORM_RLE	4	/* run length: (count, byte) pairs */
+
+/* for SHOFER_IOC_TRANSFORM */
+struct shofer_transform {
+	__u32 stage;		/* stage index */
+	__u32 type;		/* SHOFER_XFORM_* */
+	__u8 table[256];	/* for SHOFER_XFORM_MAP and _FILTER */
+};
+
+#define SHOFER_IOC_MAGIC	'y'
+
+/* move up to *arg bytes through every stage; returns bytes moved to out */
+#define SHOFER_IOC_MOVE		_IOW(SHOFER_IOC_MAGIC, 1, __u32)
+/* discard data in buffers given with *arg (SHOFER_IN | SHOFER_OUT) */
+#define SHOFER_IOC_FLUSH	_IOW(SHOFER_IOC_MAGIC, 2, __u32)
+/* copy data from buffer without removing it; returns bytes copied */
+#define SHOFER_IOC_PEEK		_IOW(SHOFER_IOC_MAGIC, 3, struct shofer_peek)
+/* get buffer state and counters */
+#define SHOFER_IOC_STATS	_IOR(SHOFER_IOC_MAGIC, 4, struct shofer_stats)
+/* get stage configuration and state */
+#define SHOFER_IOC_STAGE_GET	_IOWR(SHOFER_IOC_MAGIC, 5, struct shofer_stage)
+/* set stage configuration (mode, rate, record_size, period_us) */
+#define SHOFER_IOC_STAGE_SET	_IOW(SHOFER_IOC_MAGIC, 6, struct shofer_stage)
+/* set transformation done by stage */
+#define SHOFER_IOC_TRANSFORM	_IOW(SHOFER_IOC_MAGIC, 7, struct shofer_transform)
@@ -2,23 +2,52 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 
+#include "../shofer_uapi.h"
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s file-name command [argument]\n", prog);
+	fprintf(stderr, "commands:\n"
+		"\tmove N      move up to N bytes from input to output buffer\n"
+		"\tflush in|out|all  discard data from buffer(s)\n"
+		"\tpeek in|out show data in buffer (without removing it)\n"
+		"\tstats       show buffer state and counters\n"
+		"\tstage I     show stage I configuration and state\n"
+		"\tstage I timer|ioctl [rate [record_size [period_us]]]\n"
+		"\t            set stage I pump\n"
+		"\ttransform I none|crc|rle  set stage I transformation\n"
+		"\ttransform I map FROM TO   replace chars in FROM with TO\n"
+		"\ttransform I filter CHARS  drop CHARS\n");
+}
+
+static __u32 which(char *arg)
+{
+	if (!strcmp(arg, "in"))
+		return SHOFER_IN;
+	if (!strcmp(arg, "out"))
+		return SHOFER_OUT;
+	if (!strcmp(arg, "all"))
+		return SHOFER_IN | SHOFER_OUT;
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int fd, count;
-	unsigned long cmd;
-
-	if (argc < 3) {
-		fprintf(stderr, "Usage: %s file-name ioctl-command\n", argv[0]);
-		return -1;
-	}
+	__u32 n;
+	char buf[4096];
+	struct shofer_peek peek;
+	struct shofer_stats stats;
+	struct shofer_stage stage;
+	struct shofer_transform xf;
+	int i;
 
-	cmd = atol(argv[2]);
-	if (cmd < 1 || cmd > 100) {
-		fprintf(stderr, "Usage: %s file-name ioctl-command\n", argv[0]);
-		fprintf(stderr, "ioctl-command must be a number from {1,100}\n");
+	if (argc < 3 || (strcmp(argv[2], "stats") && argc < 4)) {
+		usage(argv[0]);
 		return -1;
 	}
 
@@ -28,7 +57,86 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	count = ioctl(fd, cmd);
+	if (!strcmp(argv[2], "move")) {
+		n = atol(argv[3]);
+		count = ioctl(fd, SHOFER_IOC_MOVE, &n);
+	}
+	else if (!strcmp(argv[2], "flush")) {
+		n = which(argv[3]);
+		count = ioctl(fd, SHOFER_IOC_FLUSH, &n);
+	}
+	else if (!strcmp(argv[2], "peek")) {
+		peek.buf = (__u64) (unsigned long) buf;
+		peek.len = sizeof(buf);
+		peek.which = which(argv[3]);
+		count = ioctl(fd, SHOFER_IOC_PEEK, &peek);
+		if (count >= 0)
+			printf("%.*s\n", count, buf);
+	}
+	else if (!strcmp(argv[2], "stats")) {
+		count = ioctl(fd, SHOFER_IOC_STATS, &stats);
+		if (count >= 0)
+			printf("size=%u in_len=%u out_len=%u written=%llu "
+				"moved=%llu read=%llu\n", stats.size,
+				stats.in_len, stats.out_len,
+				(unsigned long long) stats.written,
+				(unsigned long long) stats.moved,
+				(unsigned long long) stats.read);
+	}
+	else if (!strcmp(argv[2], "stage") && argc == 4) {
+		memset(&stage, 0, sizeof(stage));
+		stage.stage = atol(argv[3]);
+		count = ioctl(fd, SHOFER_IOC_STAGE_GET, &stage);
+		if (count >= 0)
+			printf("stage %u/%u: mode=%s rate=%u record_size=%u "
+				"period_us=%u in_len=%u out_avail=%u moved=%llu "
+				"produced=%llu transform=%u\n",
+				stage.stage, stage.stages,
+				stage.mode == SHOFER_PUMP_TIMER ? "timer" : "ioctl",
+				stage.rate, stage.record_size, stage.period_us,
+				stage.in_len, stage.out_avail,
+				(unsigned long long) stage.moved,
+				(unsigned long long) stage.produced, stage.transform);
+	}
+	else if (!strcmp(argv[2], "stage")) {
+		memset(&stage, 0, sizeof(stage));
+		stage.stage = atol(argv[3]);
+		stage.mode = strcmp(argv[4], "timer") ?
+			SHOFER_PUMP_IOCTL : SHOFER_PUMP_TIMER;
+		stage.rate = argc > 5 ? atol(argv[5]) : 0;
+		stage.record_size = argc > 6 ? atol(argv[6]) : 1;
+		stage.period_us = argc > 7 ? atol(argv[7]) : 0;
+		count = ioctl(fd, SHOFER_IOC_STAGE_SET, &stage);
+	}
+	else if (!strcmp(argv[2], "transform") && argc > 4) {
+		memset(&xf, 0, sizeof(xf));
+		xf.stage = atol(argv[3]);
+		for (i = 0; i < 256; i++)
+			xf.table[i] = i;
+		if (!strcmp(argv[4], "crc"))
+			xf.type = SHOFER_XFORM_CRC;
+		else if (!strcmp(argv[4], "rle"))
+			xf.type = SHOFER_XFORM_RLE;
+		else if (!strcmp(argv[4], "map") && argc > 6) {
+			xf.type = SHOFER_XFORM_MAP;
+			for (i = 0; argv[5][i] && argv[6][i]; i++)
+				xf.table[(unsigned char) argv[5][i]] = argv[6][i];
+		}
+		else if (!strcmp(argv[4], "filter") && argc > 5) {
+			xf.type = SHOFER_XFORM_FILTER;
+			xf.table[0] = 1;
+			for (i = 0; argv[5][i]; i++)
+				xf.table[(unsigned char) argv[5][i]] = 0;
+		}
+		else
+			xf.type = SHOFER_XFORM_NONE;
+		count = ioctl(fd, SHOFER_IOC_TRANSFORM, &xf);
+	}
+	else {
+		usage(argv[0]);
+		return -1;
+	}
+
 	if (count == -1) {
 		perror("ioctl error");
 		return -1;
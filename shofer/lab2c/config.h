@@ -17,18 +17,63 @@
 #define LICENSE		"Dual BSD/GPL"
 
 #define BUFFER_SIZE	32
-#define MAX_ACTIVE_PROC 3
+#define BUFFER_SIZE_MAX	(1 << 24)	/* for resize (sysfs) */
+#define MAX_ACTIVE_PROC 3	/* default for readers and for writers */
 
-/* Circular buffer */
+#define RECORD_HDR	2 /* record length size in record mode (kfifo_rec_ptr_2) */
+
+/* Circular buffer; device buffer's data is allocated separately (kvmalloc) */
 struct buffer {
-	struct kfifo fifo;
+	union {
+		struct kfifo fifo;		/* byte stream */
+		struct kfifo_rec_ptr_2 rec;	/* record mode: length + data */
+	};
+	char *rbuf, *wbuf;	/* record mode: one record for reader/writer */
+	void *data;		/* allocated data (fifo, rbuf, wbuf), if separate */
 	struct mutex lock;	/* prevent parallel access */
+	struct mutex rlock, wlock; /* spsc mode: one reader, one writer at a time */
+
+	/*
+	 * Open files per direction. While there is at most one reader and
+	 * one writer kfifo needs no locking (spsc is set and lock is skipped).
+	 * Lockless operations run in spsc_srcu read side section, holding
+	 * only lock of their direction (an open file can be shared), so
+	 * record mode's rbuf and wbuf have one user too.
+	 */
+	int readers, writers;
+	bool spsc;
+
+	/* readers wait for data, writers for free space */
+	struct wait_queue_head rq, wq;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Session (session mode): state of one open file, in private_data
+ * Reader's session has its own buffer; writer's is paired with a reader's
+ * session and uses its buffer.
+ */
+struct session {
+	u32 id;			/* for pairing (SHOFER_IOC_PAIR) */
+	struct kref ref;	/* open file and paired writers */
+	struct buffer *buffer;	/* reader: own buffer, NULL for writer */
+	struct session *peer;	/* writer: paired reader's session */
+};
+
+/*
+ * Admission gate: at most *limit files can be open at once, others wait
+ * in wait queue; freed place is handed to the first one (FIFO order)
+ */
+struct gate {
+	atomic_t active;	/* admitted (open) files */
+	int *limit;		/* module parameter */
+	struct wait_queue_head wait;
 };
 
 /* Device driver */
 struct shofer_dev {
 	dev_t dev_no;		/* device number */
 	struct cdev cdev;	/* Char device structure */
+	struct device *dev;	/* in shofer class, with tunable attributes */
 	struct buffer *buffer;	/* Pointer to buffer */
-	int active_proc;
+	struct gate rgate, wgate; /* for readers and for writers */
 };
@@ -3,24 +3,27 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/ioctl.h>
+
+#include "shofer_uapi.h"
 
 #define READ 0
 #define WRITE 1
 
-#define READ_SLEEP 10
-#define READ_CHUNK 8
-#define WRITE_SLEEP 5
+#define READ_CHUNK 32 /* in record mode longer messages are truncated */
+#define WRITE_SLEEP 1
 
 int main(int argc, char *argv[])
 {
 	int fd, mode;
+	__u32 session;
 	char *msg = "cjevovodjevelik ";
 	ssize_t rsize;
 	ssize_t wsize;
 	char buf[READ_CHUNK];
 
-	if (argc != 3) {
-		printf("Usage: %s file-name mode-type\n", argv[0]);
+	if (argc != 3 && argc != 4) {
+		printf("Usage: %s file-name mode-type [reader-session]\n", argv[0]);
 		exit(1);
 	}
 
@@ -38,16 +41,17 @@ int main(int argc, char *argv[])
 
 		printf("Reading process started\n");
 
+		// in session mode writers need session id to pair with reader
+		if (ioctl(fd, SHOFER_IOC_SESSION, &session) == 0)
+			printf("Reader session=%u\n", session);
+
 		// read from pipeline in loop
 		while (1) {
 
-			// block read while empty
-			while ((rsize = read(fd, buf, READ_CHUNK)) == 0) {
-				printf("Trying to read from %s ...\n", argv[1]);
-				sleep(READ_SLEEP);
-			}
+			// read blocks while pipeline is empty
+			rsize = read(fd, buf, READ_CHUNK);
 
-			// exit on invalid mode
+			// exit on error
 			if (rsize == -1) {
 				printf("Error reading\n");
 				close(fd);
@@ -55,10 +59,7 @@ int main(int argc, char *argv[])
 			}
 
 			// print what is read and its size
-			printf("Successfully read from %s: size=%ld msg=%s\n", argv[1], rsize, buf);
-
-			// clear local buffer
-			memset(buf, '\0', sizeof(buf));
+			printf("Successfully read from %s: size=%ld msg=%.*s\n", argv[1], rsize, (int) rsize, buf);
 		}
 
 	} else if (mode == WRITE) {
@@ -72,26 +73,32 @@ int main(int argc, char *argv[])
 
 		printf("Writing process started\n");
 
+		// in session mode pair with given reader session
+		if (argc == 4) {
+			session = atoi(argv[3]);
+			if (ioctl(fd, SHOFER_IOC_PAIR, &session) == -1) {
+				perror("pairing failed");
+				close(fd);
+				exit(1);
+			}
+		}
+
 		// write to pipeline in loop
 		while (1) {
 
-			// block write while not enough space
-			while ((wsize = write(fd, msg, strlen(msg))) != strlen(msg)) {
-				printf("Trying to write '%s' to %s ...\n", msg, argv[1]);
-
-				if (wsize == 0) {
-					printf("Not enough space at the moment, please wait ...\n");
-				} else if (wsize == -1) {
-					printf("Error writing\n");
-					close(fd);
-					exit(1);
-				}
-
-				sleep(WRITE_SLEEP);
+			// write blocks until there is enough space for whole message
+			wsize = write(fd, msg, strlen(msg));
+			if (wsize == -1) {
+				printf("Error writing\n");
+				close(fd);
+				exit(1);
 			}
 
 			// print what is written
 			printf("Successfully wrote to %s: size=%ld msg=%s\n", argv[1], wsize, msg);
+
+			// pace the writer so the output stays readable
+			sleep(WRITE_SLEEP);
 		}
 	} else {
 		// invalid mode
@@ -17,52 +17,136 @@
 #include <linux/moduleparam.h>
 
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/topology.h>
 #include <linux/errno.h>
 #include <linux/types.h>
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
 #include <linux/kfifo.h>
 #include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/sched/signal.h>
+#include <linux/srcu.h>
+#include <linux/uio.h>
+#include <linux/kref.h>
+#include <linux/xarray.h>
+#include <linux/device.h>
+#include <linux/version.h>
 
+#include "shofer_uapi.h"
 #include "config.h"
 
+/* splice into pipe through read_iter (generic helper was renamed in 6.5) */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+#define generic_splice_read	generic_file_splice_read
+#else
+#define generic_splice_read	copy_splice_read
+#endif
+
 /* Buffer size */
 static int buffer_size = BUFFER_SIZE;
 
-/* Max active proc */
-static int max_active_proc = MAX_ACTIVE_PROC;
+/* Lockless access while buffer has single reader and single writer */
+static bool spsc = true;
+
+/* Message framed buffer: each write is one record, each read returns one */
+static bool record_mode = false;
+
+/* Private buffer for each reader, writers are paired with readers */
+static bool session_mode = false;
+
+/* Max open files for reading and for writing; others wait in open */
+static int max_readers = MAX_ACTIVE_PROC;
+static int max_writers = MAX_ACTIVE_PROC;
+
+/* CPU on which reader runs (-1 any); buffer data is allocated on its node */
+static int reader_cpu = -1;
 
 /* Parameter buffer_size can be given at module load time */
 module_param(buffer_size, int, S_IRUGO);
 MODULE_PARM_DESC(buffer_size, "Buffer size in bytes, must be a power of 2");
+module_param(spsc, bool, S_IRUGO);
+MODULE_PARM_DESC(spsc, "Don't lock buffer while it has one reader and one writer");
+module_param(record_mode, bool, S_IRUGO);
+MODULE_PARM_DESC(record_mode, "Each write stores one message, each read returns one");
+module_param(session_mode, bool, S_IRUGO);
+MODULE_PARM_DESC(session_mode, "Private buffer per reader; writers pair with readers");
+module_param(max_readers, int, S_IRUGO);
+MODULE_PARM_DESC(max_readers, "Max files open for reading at once");
+module_param(max_writers, int, S_IRUGO);
+MODULE_PARM_DESC(max_writers, "Max files open for writing at once");
+module_param(reader_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(reader_cpu, "Allocate buffer on this CPU's NUMA node (-1 any)");
 
 MODULE_AUTHOR(AUTHOR);
 MODULE_LICENSE(LICENSE);
 
+DEFINE_STATIC_SRCU(spsc_srcu); /* for switching buffers out of spsc mode */
+
 struct shofer_dev *Shofer = NULL;
 struct buffer *Buffer = NULL;
 static dev_t Dev_no = 0;
+static struct class *shofer_class;
+
+/* session mode: sessions and their buffers, sessions by id */
+static struct kmem_cache *session_cache;
+static struct kmem_cache *buffer_cache;
+static DEFINE_XARRAY_ALLOC(sessions);
 
 /* prototypes */
 static struct buffer *buffer_create(size_t, int *);
+static int buffer_init(struct buffer *, void *, size_t);
+static size_t buffer_data_size(size_t);
+static void *buffer_data_alloc(size_t);
+static int buffer_resize(struct buffer *, size_t);
+static unsigned int buffer_capacity(struct buffer *);
 static void buffer_delete(struct buffer *);
+static int buffer_lock(struct buffer *, fmode_t, int *);
+static void buffer_unlock(struct buffer *, fmode_t, int);
+static void buffer_users(struct buffer *, fmode_t, int);
+static unsigned int buffer_avail(struct buffer *);
 static struct shofer_dev *shofer_create(dev_t, struct file_operations *,
 	struct buffer *, int *);
 static void shofer_delete(struct shofer_dev *);
+static void gate_init(struct gate *, int *);
+static int gate_enter(struct gate *, bool);
+static void gate_leave(struct gate *);
+static void gate_limit(struct gate *, int);
+static void gate_handoff(struct gate *);
+static int gate_wake(struct wait_queue_entry *, unsigned int, int, void *);
+static struct session *session_create(fmode_t, int *);
+static void session_close(struct session *);
+static void session_put(struct session *);
+static int session_pair(struct session *, u32);
+static struct buffer *file_buffer(struct file *);
+static bool buffer_closed(struct buffer *);
 static void cleanup(void);
 static void dump_buffer(struct buffer *);
 
 static int shofer_open(struct inode *, struct file *);
 static int shofer_release(struct inode *, struct file *);
-static ssize_t shofer_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t shofer_write(struct file *, const char __user *, size_t, loff_t *);
+static ssize_t shofer_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_write_iter(struct kiocb *, struct iov_iter *);
+static ssize_t shofer_splice_read(struct file *, loff_t *,
+	struct pipe_inode_info *, size_t, unsigned int);
+static ssize_t shofer_splice_write(struct pipe_inode_info *, struct file *,
+	loff_t *, size_t, unsigned int);
+static long shofer_ioctl(struct file *, unsigned int, unsigned long);
+static ssize_t fifo_to_iter(struct kfifo *, struct iov_iter *);
+static ssize_t fifo_from_iter(struct kfifo *, struct iov_iter *);
+static ssize_t records_to_iter(struct buffer *, struct iov_iter *);
+static ssize_t records_from_iter(struct buffer *, struct iov_iter *);
 
 static struct file_operations shofer_fops = {
 	.owner =    THIS_MODULE,
 	.open =     shofer_open,
 	.release =  shofer_release,
-	.read =     shofer_read,
-	.write =    shofer_write
+	.read_iter =  shofer_read_iter,
+	.write_iter = shofer_write_iter,
+	.splice_read =  shofer_splice_read,
+	.splice_write = shofer_splice_write,
+	.unlocked_ioctl = shofer_ioctl
 };
 
 /* init module */
@@ -92,6 +176,26 @@ static int __init shofer_module_init(void)
 		goto no_driver;
 	Buffer = buffer;
 
+	/* session mode: device buffer is not used for data */
+	if (session_mode) {
+		session_cache = KMEM_CACHE(session, 0);
+		buffer_cache = kmem_cache_create("shofer_buffer",
+			sizeof(struct buffer) + buffer_data_size(buffer_size), 0,
+			SLAB_HWCACHE_ALIGN, NULL);
+		if (!session_cache || !buffer_cache) {
+			retval = -ENOMEM;
+			goto no_driver;
+		}
+	}
+
+	/* class for device with tunable attributes in sysfs */
+	shofer_class = class_create(DRIVER_NAME);
+	if (IS_ERR(shofer_class)) {
+		retval = PTR_ERR(shofer_class);
+		shofer_class = NULL;
+		goto no_driver;
+	}
+
 	/* create a device */
 	shofer = shofer_create(dev_no, &shofer_fops, buffer, &retval);
 	if (!shofer)
@@ -114,10 +218,14 @@ no_driver:
 static void cleanup(void) {
 	if (Shofer)
 		shofer_delete(Shofer);
+	if (shofer_class)
+		class_destroy(shofer_class);
 	if (Buffer)
 		buffer_delete(Buffer);
 	if (Dev_no)
 		unregister_chrdev_region(Dev_no, 1);
+	kmem_cache_destroy(buffer_cache); /* all files are closed */
+	kmem_cache_destroy(session_cache);
 }
 
 /* called when module exit */
@@ -131,32 +239,295 @@ static void __exit shofer_module_exit(void)
 module_init(shofer_module_init);
 module_exit(shofer_module_exit);
 
-/* Create and initialize a single buffer */
+/*
+ * Create and initialize a single buffer
+ * Data is allocated separately, so it can be replaced (buffer_resize).
+ */
 static struct buffer *buffer_create(size_t size, int *retval)
 {
-	struct buffer *buffer = kmalloc(sizeof(struct buffer) + size, GFP_KERNEL);
-	if (!buffer) {
+	struct buffer *buffer = kmalloc(sizeof(struct buffer), GFP_KERNEL);
+	void *data = buffer_data_alloc(size);
+	if (!buffer || !data) {
+		kfree(buffer);
+		kvfree(data);
 		*retval = -ENOMEM;
 		printk(KERN_NOTICE "shofer:kmalloc failed\n");
 		return NULL;
 	}
-	*retval = kfifo_init(&buffer->fifo, buffer + 1, size);
+	*retval = buffer_init(buffer, data, size);
 	if (*retval) {
+		kvfree(data);
 		kfree(buffer);
 		printk(KERN_NOTICE "shofer:kfifo_init failed\n");
 		return NULL;
 	}
-	mutex_init(&buffer->lock);
-	*retval = 0;
+	buffer->data = data;
 
 	return buffer;
 }
 
+/* Data size: in record mode also space for copying one record in and out */
+static size_t buffer_data_size(size_t size)
+{
+	return size + (record_mode ? 2 * size : 0);
+}
+
+/*
+ * Allocate data for buffer of given size
+ * kvmalloc falls back to vmalloc for large buffers. Data is placed on the
+ * reader's node: reader touches all of it, writer only what it adds.
+ */
+static void *buffer_data_alloc(size_t size)
+{
+	int node = NUMA_NO_NODE;
+
+	if (reader_cpu >= 0 && reader_cpu < nr_cpu_ids && cpu_possible(reader_cpu))
+		node = cpu_to_node(reader_cpu);
+
+	return kvmalloc_node(buffer_data_size(size), GFP_KERNEL, node);
+}
+
+/* Initialize buffer with data of buffer_data_size(size) bytes */
+static int buffer_init(struct buffer *buffer, void *data, size_t size)
+{
+	int retval;
+
+	if (record_mode)
+		retval = kfifo_init(&buffer->rec, data, size);
+	else
+		retval = kfifo_init(&buffer->fifo, data, size);
+	if (retval)
+		return retval;
+	buffer->rbuf = record_mode ? (char *) data + size : NULL;
+	buffer->wbuf = record_mode ? buffer->rbuf + size : NULL;
+	buffer->data = NULL; /* data is part of buffer's allocation */
+	mutex_init(&buffer->lock);
+	mutex_init(&buffer->rlock);
+	mutex_init(&buffer->wlock);
+	buffer->readers = buffer->writers = 0;
+	buffer->spsc = spsc;
+	init_waitqueue_head(&buffer->rq);
+	init_waitqueue_head(&buffer->wq);
+
+	return 0;
+}
+
 static void buffer_delete(struct buffer *buffer)
 {
+	kvfree(buffer->data);
 	kfree(buffer);
 }
 
+/*
+ * Change buffer size, keeping data in it
+ * Lockless operations are stopped (as in buffer_users) and buffer is locked
+ * while data is moved into new fifo, so no reader or writer sees it half
+ * done. Tasks waiting for data or space recheck their condition on new fifo.
+ */
+static int buffer_resize(struct buffer *buffer, size_t size)
+{
+	struct kfifo fifo;
+	void *data, *old;
+	unsigned int len;
+	int retval;
+
+	if (size <= RECORD_HDR || size > BUFFER_SIZE_MAX)
+		return -EINVAL;
+	size = roundup_pow_of_two(size);
+
+	data = buffer_data_alloc(size);
+	if (!data)
+		return -ENOMEM;
+	retval = kfifo_init(&fifo, data, size);
+	if (retval) {
+		kvfree(data);
+		return retval;
+	}
+
+	mutex_lock(&buffer->lock);
+
+	/* wait for lockless operations to finish; next ones will lock */
+	WRITE_ONCE(buffer->spsc, false);
+	synchronize_srcu(&spsc_srcu);
+
+	/* in record mode records (with their headers) are copied as bytes */
+	len = kfifo_len(&buffer->fifo);
+	if (len > size) {
+		retval = -ENOSPC;
+		old = data;
+	} else {
+		fifo.kfifo.in = kfifo_out(&buffer->fifo, data, len);
+		buffer->fifo = fifo;
+		buffer->rbuf = record_mode ? (char *) data + size : NULL;
+		buffer->wbuf = record_mode ? buffer->rbuf + size : NULL;
+		old = buffer->data;
+		buffer->data = data;
+	}
+
+	WRITE_ONCE(buffer->spsc,
+		spsc && buffer->readers <= 1 && buffer->writers <= 1);
+
+	mutex_unlock(&buffer->lock);
+
+	kvfree(old);
+
+	/* space changed: writers (also with too large messages) recheck */
+	wake_up_interruptible_all(&buffer->wq);
+
+	return retval;
+}
+
+/* Largest message that fits into (empty) buffer */
+static unsigned int buffer_capacity(struct buffer *buffer)
+{
+	unsigned int size = READ_ONCE(buffer->fifo.kfifo.mask) + 1;
+
+	return record_mode ? size - RECORD_HDR : size;
+}
+
+/*
+ * Start buffer operation in direction mode (FMODE_READ or FMODE_WRITE):
+ * lock buffer, unless it is used by single reader and single writer, in
+ * which case kfifo can be used without buffer lock. A file can still be
+ * shared (fork, dup, threads), so operations in the same direction are
+ * serialized with direction's lock (not contended by a single user).
+ * *idx is srcu index for lockless operation, -1 when buffer is locked.
+ */
+static int buffer_lock(struct buffer *buffer, fmode_t mode, int *idx)
+{
+	*idx = srcu_read_lock(&spsc_srcu);
+	if (READ_ONCE(buffer->spsc)) {
+		if (!mutex_lock_interruptible(mode & FMODE_READ ?
+				&buffer->rlock : &buffer->wlock))
+			return 0;
+		srcu_read_unlock(&spsc_srcu, *idx);
+		return -ERESTARTSYS;
+	}
+	srcu_read_unlock(&spsc_srcu, *idx);
+
+	*idx = -1;
+	if (mutex_lock_interruptible(&buffer->lock))
+		return -ERESTARTSYS;
+
+	return 0;
+}
+static void buffer_unlock(struct buffer *buffer, fmode_t mode, int idx)
+{
+	if (idx >= 0) {
+		mutex_unlock(mode & FMODE_READ ? &buffer->rlock : &buffer->wlock);
+		srcu_read_unlock(&spsc_srcu, idx);
+	} else {
+		mutex_unlock(&buffer->lock);
+	}
+}
+
+/* Update number of readers and writers (on open/close) and locking mode */
+static void buffer_users(struct buffer *buffer, fmode_t mode, int change)
+{
+	bool lockless;
+
+	mutex_lock(&buffer->lock);
+
+	if (mode & FMODE_READ)
+		buffer->readers += change;
+	if (mode & FMODE_WRITE)
+		buffer->writers += change;
+
+	lockless = spsc && buffer->readers <= 1 && buffer->writers <= 1;
+	if (buffer->spsc && !lockless) {
+		/* wait for lockless operations to finish; next ones will lock */
+		WRITE_ONCE(buffer->spsc, false);
+		synchronize_srcu(&spsc_srcu);
+	}
+	WRITE_ONCE(buffer->spsc, lockless);
+
+	mutex_unlock(&buffer->lock);
+}
+
+/*
+ * sysfs attributes; changes are applied to running device
+ */
+static ssize_t buffer_size_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct shofer_dev *shofer = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", kfifo_size(&shofer->buffer->fifo));
+}
+static ssize_t buffer_size_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct shofer_dev *shofer = dev_get_drvdata(dev);
+	unsigned int size;
+	int retval;
+
+	if (session_mode) /* sessions' buffers are from cache of fixed size */
+		return -EOPNOTSUPP;
+
+	retval = kstrtouint(buf, 0, &size);
+	if (retval)
+		return retval;
+
+	retval = buffer_resize(shofer->buffer, size);
+	if (retval)
+		return retval;
+	buffer_size = kfifo_size(&shofer->buffer->fifo);
+
+	return count;
+}
+static DEVICE_ATTR_RW(buffer_size);
+
+static ssize_t gate_show(struct gate *gate, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", READ_ONCE(*gate->limit));
+}
+static ssize_t gate_store(struct gate *gate, const char *buf, size_t count)
+{
+	int limit, retval;
+
+	retval = kstrtoint(buf, 0, &limit);
+	if (retval)
+		return retval;
+	if (limit < 0)
+		return -EINVAL;
+
+	gate_limit(gate, limit);
+
+	return count;
+}
+static ssize_t max_readers_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	return gate_show(&((struct shofer_dev *) dev_get_drvdata(dev))->rgate, buf);
+}
+static ssize_t max_readers_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	return gate_store(&((struct shofer_dev *) dev_get_drvdata(dev))->rgate,
+		buf, count);
+}
+static DEVICE_ATTR_RW(max_readers);
+static ssize_t max_writers_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	return gate_show(&((struct shofer_dev *) dev_get_drvdata(dev))->wgate, buf);
+}
+static ssize_t max_writers_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	return gate_store(&((struct shofer_dev *) dev_get_drvdata(dev))->wgate,
+		buf, count);
+}
+static DEVICE_ATTR_RW(max_writers);
+
+static struct attribute *shofer_attrs[] = {
+	&dev_attr_buffer_size.attr,
+	&dev_attr_max_readers.attr,
+	&dev_attr_max_writers.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(shofer);
+
 /* Create and initialize a single shofer_dev */
 static struct shofer_dev *shofer_create(dev_t dev_no,
 	struct file_operations *fops, struct buffer *buffer, int *retval)
@@ -169,6 +540,8 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 	}
 	memset(shofer, 0, sizeof(struct shofer_dev));
 	shofer->buffer = buffer;
+	gate_init(&shofer->rgate, &max_readers);
+	gate_init(&shofer->wgate, &max_writers);
 
 	cdev_init(&shofer->cdev, fops);
 	shofer->cdev.owner = THIS_MODULE;
@@ -179,24 +552,271 @@ static struct shofer_dev *shofer_create(dev_t dev_no,
 		printk(KERN_NOTICE "Error (%d) when adding device shofer\n",
 			*retval);
 		kfree(shofer);
-		shofer = NULL;
+		return NULL;
 	}
 
-	// set active process to zero
-	shofer->active_proc = 0;
+	/* /sys/class/shofer/shofer/: buffer_size, max_readers, max_writers */
+	shofer->dev = device_create_with_groups(shofer_class, NULL, dev_no,
+		shofer, shofer_groups, DRIVER_NAME);
+	if (IS_ERR(shofer->dev)) {
+		*retval = PTR_ERR(shofer->dev);
+		printk(KERN_NOTICE "Error (%d) when creating device shofer\n",
+			*retval);
+		cdev_del(&shofer->cdev);
+		kfree(shofer);
+		return NULL;
+	}
 
 	return shofer;
 }
 static void shofer_delete(struct shofer_dev *shofer)
 {
+	device_destroy(shofer_class, shofer->dev_no);
 	cdev_del(&shofer->cdev);
 	kfree(shofer);
 }
 
+
+static void gate_init(struct gate *gate, int *limit)
+{
+	atomic_set(&gate->active, 0);
+	gate->limit = limit;
+	init_waitqueue_head(&gate->wait);
+}
+
+/* Take a place if one is free (with gate->wait.lock held) */
+static bool gate_try(struct gate *gate)
+{
+	if (atomic_read(&gate->active) >= READ_ONCE(*gate->limit))
+		return false;
+	atomic_inc(&gate->active);
+
+	return true;
+}
+
+/*
+ * Waiting task is woken with its place: entry is removed from queue even
+ * if task isn't sleeping at the moment (as autoremove_wake_function would
+ * skip it), so place is never lost
+ */
+static int gate_wake(struct wait_queue_entry *wait, unsigned int mode,
+	int sync, void *key)
+{
+	default_wake_function(wait, mode, sync, key);
+	list_del_init(&wait->entry);
+
+	return 1;
+}
+
+/*
+ * Wait for a place at gate (or fail with -EAGAIN if nonblock)
+ * Newcomers don't pass tasks already waiting: they queue behind them.
+ * A freed place is handed directly to the first waiting task (its entry is
+ * removed from queue when it is woken, see gate_leave), so a newcomer can't
+ * take it meanwhile. Queue and active are changed with queue's lock held.
+ */
+static int gate_enter(struct gate *gate, bool nonblock)
+{
+	DEFINE_WAIT_FUNC(wait, gate_wake);
+	bool admitted, interrupted;
+
+	spin_lock_irq(&gate->wait.lock);
+	if (!waitqueue_active(&gate->wait) && gate_try(gate)) {
+		spin_unlock_irq(&gate->wait.lock);
+		return 0;
+	}
+	if (nonblock) {
+		spin_unlock_irq(&gate->wait.lock);
+		return -EAGAIN;
+	}
+	/* exclusive: added at tail, first one is woken when place is freed */
+	wait.flags |= WQ_FLAG_EXCLUSIVE;
+	__add_wait_queue_entry_tail(&gate->wait, &wait);
+	spin_unlock_irq(&gate->wait.lock);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_irq(&gate->wait.lock);
+		admitted = list_empty(&wait.entry);
+		interrupted = !admitted && signal_pending(current);
+		if (interrupted)
+			list_del(&wait.entry); /* leave queue */
+		spin_unlock_irq(&gate->wait.lock);
+		if (admitted || interrupted)
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return admitted ? 0 : -ERESTARTSYS;
+}
+
+/* Hand place to first waiting task (with gate->wait.lock held) */
+static void gate_handoff(struct gate *gate)
+{
+	wake_up_locked(&gate->wait); /* gate_wake: it is admitted */
+}
+
+/* Free a place; first waiting task takes it */
+static void gate_leave(struct gate *gate)
+{
+	spin_lock_irq(&gate->wait.lock);
+	if (waitqueue_active(&gate->wait) &&
+			atomic_read(&gate->active) <= READ_ONCE(*gate->limit))
+		gate_handoff(gate); /* place stays taken */
+	else
+		atomic_dec(&gate->active);
+	spin_unlock_irq(&gate->wait.lock);
+}
+
+/*
+ * Change limit; when raised, new places are handed to waiting tasks (in
+ * order). When lowered, open files stay, new ones wait.
+ */
+static void gate_limit(struct gate *gate, int limit)
+{
+	spin_lock_irq(&gate->wait.lock);
+	WRITE_ONCE(*gate->limit, limit);
+	while (waitqueue_active(&gate->wait) && gate_try(gate))
+		gate_handoff(gate);
+	spin_unlock_irq(&gate->wait.lock);
+}
+
+/* Create session for file opened with mode; reader gets a buffer */
+static struct session *session_create(fmode_t mode, int *retval)
+{
+	struct session *session = kmem_cache_zalloc(session_cache, GFP_KERNEL);
+	if (!session) {
+		*retval = -ENOMEM;
+		return NULL;
+	}
+	kref_init(&session->ref);
+
+	if (mode & FMODE_READ) {
+		session->buffer = kmem_cache_alloc(buffer_cache, GFP_KERNEL);
+		if (!session->buffer) {
+			*retval = -ENOMEM;
+			goto no_session;
+		}
+		*retval = buffer_init(session->buffer, session->buffer + 1,
+			buffer_size);
+		if (*retval)
+			goto no_session;
+		buffer_users(session->buffer, mode, 1);
+	}
+
+	*retval = xa_alloc(&sessions, &session->id, session, xa_limit_31b,
+		GFP_KERNEL);
+	if (*retval)
+		goto no_session;
+
+	return session;
+
+no_session:
+	if (session->buffer)
+		kmem_cache_free(buffer_cache, session->buffer);
+	kmem_cache_free(session_cache, session);
+	return NULL;
+}
+
+static void session_release(struct kref *ref)
+{
+	struct session *session = container_of(ref, struct session, ref);
+
+	if (session->buffer)
+		kmem_cache_free(buffer_cache, session->buffer);
+	kmem_cache_free(session_cache, session);
+}
+static void session_put(struct session *session)
+{
+	kref_put(&session->ref, session_release);
+}
+
+/*
+ * Close session's file: it can't be paired any more; paired writers of
+ * a reader's session fail from now on (buffer has no readers)
+ */
+static void session_close(struct session *session)
+{
+	struct session *peer = session->peer;
+
+	xa_erase(&sessions, session->id);
+
+	if (session->buffer) {
+		buffer_users(session->buffer, FMODE_READ, -1);
+		wake_up_interruptible(&session->buffer->wq);
+	}
+	if (peer) {
+		buffer_users(peer->buffer, FMODE_WRITE, -1);
+		session_put(peer);
+	}
+
+	session_put(session);
+}
+
+/* Connect writer's session with reader's session given with id */
+static int session_pair(struct session *session, u32 id)
+{
+	struct session *peer;
+
+	if (session->buffer) /* reader */
+		return -EINVAL;
+
+	/* found session is not closed while xarray is locked */
+	xa_lock(&sessions);
+	peer = xa_load(&sessions, id);
+	if (peer)
+		kref_get(&peer->ref);
+	xa_unlock(&sessions);
+	if (!peer)
+		return -ENOENT;
+
+	if (!peer->buffer) { /* not a reader */
+		session_put(peer);
+		return -EINVAL;
+	}
+
+	buffer_users(peer->buffer, FMODE_WRITE, 1);
+
+	/* pair once; writes use peer from now on */
+	if (cmpxchg_release(&session->peer, NULL, peer)) {
+		buffer_users(peer->buffer, FMODE_WRITE, -1);
+		session_put(peer);
+		return -EISCONN;
+	}
+
+	return 0;
+}
+
+/* Buffer used by file: device's buffer or, in session mode, session's */
+static struct buffer *file_buffer(struct file *filp)
+{
+	struct shofer_dev *shofer = filp->private_data;
+	struct session *session = filp->private_data;
+	struct session *peer;
+
+	if (!session_mode)
+		return shofer->buffer;
+	if (session->buffer)
+		return session->buffer;
+
+	peer = smp_load_acquire(&session->peer);
+	return peer ? peer->buffer : NULL; /* NULL: writer not yet paired */
+}
+
+/* Session's reader has closed the file: no one will read written data */
+static bool buffer_closed(struct buffer *buffer)
+{
+	return session_mode && READ_ONCE(buffer->readers) == 0;
+}
+
 /* Called when a process calls "open" on this device */
 static int shofer_open(struct inode *inode, struct file *filp)
 {
 	struct shofer_dev *shofer; /* device information */
+	struct session *session;
+	struct gate *gate;
+	int retval;
 
 	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
 	filp->private_data = shofer; /* for other methods */
@@ -204,15 +824,27 @@ static int shofer_open(struct inode *inode, struct file *filp)
 	if ( (filp->f_flags & O_ACCMODE) != O_RDONLY && (filp->f_flags & O_ACCMODE) != O_WRONLY)
 		return -EPERM;
 
-	printk(KERN_NOTICE "Shofer max active proc allowed=%d\n", max_active_proc);
-	if (shofer->active_proc >= max_active_proc) {
-		printk(KERN_WARNING "Shofer maximum active open reached\n");
-		return -1;
+	/* wait for a place when max readers/writers are already active */
+	gate = (filp->f_mode & FMODE_READ) ? &shofer->rgate : &shofer->wgate;
+	retval = gate_enter(gate, filp->f_flags & O_NONBLOCK);
+	if (retval)
+		return retval;
+
+	printk(KERN_NOTICE "Shofer open: readers=%d writers=%d\n",
+		atomic_read(&shofer->rgate.active),
+		atomic_read(&shofer->wgate.active));
+
+	if (session_mode) {
+		session = session_create(filp->f_mode, &retval);
+		if (!session) {
+			gate_leave(gate);
+			return retval;
+		}
+		filp->private_data = session; /* instead of device */
+		return 0;
 	}
 
-	printk(KERN_NOTICE "Shofer before open active-proc=%d\n", shofer->active_proc);
-	shofer->active_proc++;
-	printk(KERN_NOTICE "Shofer after open active-proc=%d\n", shofer->active_proc);
+	buffer_users(shofer->buffer, filp->f_mode, 1);
 
 	return 0;
 }
@@ -223,77 +855,287 @@ static int shofer_release(struct inode *inode, struct file *filp)
 	struct shofer_dev *shofer; /* device information */
 
 	shofer = container_of(inode->i_cdev, struct shofer_dev, cdev);
-	filp->private_data = shofer; /* for other methods */
 
-	printk(KERN_NOTICE "Shofer before close active-proc=%d\n", shofer->active_proc);
-	shofer->active_proc--;
-	printk(KERN_NOTICE "Shofer after close active-proc=%d\n", shofer->active_proc);
+	if (session_mode)
+		session_close(filp->private_data);
+	else
+		buffer_users(shofer->buffer, filp->f_mode, -1);
+
+	/* let next waiting opener in */
+	gate_leave((filp->f_mode & FMODE_READ) ? &shofer->rgate : &shofer->wgate);
 
 	return 0; /* nothing to do; could not set this function in fops */
 }
 
-/* Read count bytes from buffer to user space ubuf */
-static ssize_t shofer_read(struct file *filp, char __user *ubuf, size_t count,
-	loff_t *f_pos /* ignoring f_pos */)
+/* Read from buffer to user space (read, readv); ignoring file position */
+static ssize_t shofer_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
-	struct buffer *buffer = shofer->buffer;
+	struct file *filp = iocb->ki_filp;
+	struct buffer *buffer = file_buffer(filp);
 	struct kfifo *fifo = &buffer->fifo;
-	unsigned int copied;
+	int idx;
 
-	if (mutex_lock_interruptible(&buffer->lock))
+	if (iov_iter_count(to) == 0)
+		return 0;
+
+	if (buffer_lock(buffer, FMODE_READ, &idx))
 		return -ERESTARTSYS;
 
+	while (kfifo_is_empty(fifo)) { /* nothing to read */
+		buffer_unlock(buffer, FMODE_READ, idx);
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(buffer->rq, !kfifo_is_empty(fifo)))
+			return -ERESTARTSYS; /* signal */
+		if (buffer_lock(buffer, FMODE_READ, &idx))
+			return -ERESTARTSYS;
+	}
+
 	dump_buffer(buffer);
 
-	retval = kfifo_to_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		printk(KERN_NOTICE "shofer:kfifo_to_user failed\n");
+	/* all segments are filled under single lock */
+	if (record_mode)
+		retval = records_to_iter(buffer, to);
 	else
-		retval = copied;
+		retval = fifo_to_iter(fifo, to);
+	if (retval < 0)
+		printk(KERN_NOTICE "shofer:read failed (%ld)\n", (long) retval);
 
 	dump_buffer(buffer);
 
-	mutex_unlock(&buffer->lock);
+	buffer_unlock(buffer, FMODE_READ, idx);
+
+	wake_up_interruptible(&buffer->wq); /* space freed for writers */
 
 	return retval;
 }
 
-/* Write count bytes from user space ubuf to buffer */
-static ssize_t shofer_write(struct file *filp, const char __user *ubuf,
-	size_t count, loff_t *f_pos /* ignoring f_pos */)
+/* Write from user space to buffer (write, writev); ignoring file position */
+static ssize_t shofer_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
 	ssize_t retval = 0;
-	struct shofer_dev *shofer = filp->private_data;
-	struct buffer *buffer = shofer->buffer;
-	struct kfifo *fifo = &buffer->fifo;
-	unsigned int copied;
+	struct file *filp = iocb->ki_filp;
+	struct buffer *buffer = file_buffer(filp);
+	struct kfifo *fifo;
+	size_t count = iov_iter_count(from);
+	int idx;
+
+	if (!buffer) /* session not paired */
+		return -ENOTCONN;
+	if (buffer_closed(buffer))
+		return -EPIPE;
+	fifo = &buffer->fifo;
 
 	// validate message size
-	if (count > buffer_size) {
+	if (record_mode) {
+		/* wait for space for first record (segment) only */
+		count = iov_iter_single_seg_count(from);
+		if (count == 0 || count > buffer_capacity(buffer)) {
+			printk(KERN_WARNING "shofer:message size not valid for record\n");
+			return -EMSGSIZE;
+		}
+	} else if (count > buffer_capacity(buffer)) {
 		printk(KERN_WARNING "shofer:message to long for buffer\n");
-		return -1;
+		return -EMSGSIZE;
 	}
 
-	if (mutex_lock_interruptible(&buffer->lock))
+	if (buffer_lock(buffer, FMODE_WRITE, &idx))
 		return -ERESTARTSYS;
 
+	while (buffer_avail(buffer) < count) { /* whole message must fit */
+		buffer_unlock(buffer, FMODE_WRITE, idx);
+		if (buffer_closed(buffer))
+			return -EPIPE;
+		if (count > buffer_capacity(buffer)) /* buffer was resized */
+			return -EMSGSIZE;
+		if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT))
+			return -EAGAIN;
+		if (wait_event_interruptible(buffer->wq,
+				buffer_avail(buffer) >= count || buffer_closed(buffer)))
+			return -ERESTARTSYS; /* signal */
+		if (buffer_lock(buffer, FMODE_WRITE, &idx))
+			return -ERESTARTSYS;
+	}
+
 	dump_buffer(buffer);
 
-	retval = kfifo_from_user(fifo, (char __user *) ubuf, count, &copied);
-	if (retval)
-		printk(KERN_NOTICE "shofer:kfifo_from_user failed\n");
+	/* all segments are stored under single lock */
+	if (record_mode)
+		retval = records_from_iter(buffer, from);
 	else
-		retval = copied;
+		retval = fifo_from_iter(fifo, from);
+	if (retval < 0)
+		printk(KERN_NOTICE "shofer:write failed (%ld)\n", (long) retval);
 
 	dump_buffer(buffer);
 
-	mutex_unlock(&buffer->lock);
+	buffer_unlock(buffer, FMODE_WRITE, idx);
+
+	wake_up_interruptible(&buffer->rq); /* data for readers */
 
 	return retval;
 }
 
+/*
+ * Read into pipe (splice, sendfile) through shofer_read_iter
+ * Not in record mode: records_to_iter skips the rest of each segment,
+ * while generic helper expects data to be contiguous from page start.
+ */
+static ssize_t shofer_splice_read(struct file *in, loff_t *ppos,
+	struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	if (record_mode)
+		return -EINVAL;
+
+	return generic_splice_read(in, ppos, pipe, len, flags);
+}
+
+/*
+ * Write from pipe (splice, sendfile) through shofer_write_iter
+ * Whole write must fit into buffer, so at most buffer size is taken from
+ * pipe at once; in record mode each pipe buffer becomes a record.
+ */
+static ssize_t shofer_splice_write(struct pipe_inode_info *pipe,
+	struct file *out, loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct buffer *buffer = file_buffer(out);
+
+	if (!buffer) /* session not paired */
+		return -ENOTCONN;
+
+	len = min_t(size_t, len, buffer_capacity(buffer));
+
+	return iter_file_splice_write(pipe, out, ppos, len, flags);
+}
+
+static long shofer_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct session *session = filp->private_data;
+	u32 id;
+
+	if (!session_mode)
+		return -ENOTTY;
+
+	switch (cmd) {
+	case SHOFER_IOC_SESSION:
+		return put_user(session->id, (u32 __user *) arg);
+	case SHOFER_IOC_PAIR:
+		if (get_user(id, (u32 __user *) arg))
+			return -EFAULT;
+		return session_pair(session, id);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Copy data from fifo to iterator (as kfifo_to_user, but for any iov_iter)
+ * Returns number of bytes copied or -EFAULT if nothing could be copied.
+ */
+static ssize_t fifo_to_iter(struct kfifo *fifo, struct iov_iter *to)
+{
+	struct __kfifo *f = &fifo->kfifo;
+	unsigned int size = f->mask + 1;
+	unsigned int off = f->out & f->mask;
+	size_t len, l, copied;
+
+	len = min_t(size_t, iov_iter_count(to), f->in - f->out);
+	l = min_t(size_t, len, size - off);
+
+	copied = copy_to_iter((char *) f->data + off, l, to);
+	if (copied == l && len > l)
+		copied += copy_to_iter(f->data, len - l, to);
+
+	/* data must be read before space is given back to producer */
+	smp_store_release(&f->out, f->out + copied);
+
+	return copied || !len ? copied : -EFAULT;
+}
+
+/* Copy data from iterator to fifo (as kfifo_from_user) */
+static ssize_t fifo_from_iter(struct kfifo *fifo, struct iov_iter *from)
+{
+	struct __kfifo *f = &fifo->kfifo;
+	unsigned int size = f->mask + 1;
+	unsigned int off = f->in & f->mask;
+	size_t len, l, copied;
+
+	len = min_t(size_t, iov_iter_count(from), size - (f->in - f->out));
+	l = min_t(size_t, len, size - off);
+
+	copied = copy_from_iter((char *) f->data + off, l, from);
+	if (copied == l && len > l)
+		copied += copy_from_iter(f->data, len - l, from);
+
+	/* data must be stored before consumer can see it */
+	smp_store_release(&f->in, f->in + copied);
+
+	return copied || !len ? copied : -EFAULT;
+}
+
+/*
+ * Record mode: copy one record into each segment of iterator
+ * As with datagrams, record longer than segment is truncated to segment
+ * size and the rest of it is discarded.
+ */
+static ssize_t records_to_iter(struct buffer *buffer, struct iov_iter *to)
+{
+	ssize_t retval = 0;
+	size_t seg;
+	unsigned int len;
+
+	while (iov_iter_count(to) && !kfifo_is_empty(&buffer->rec)) {
+		seg = iov_iter_single_seg_count(to);
+		len = kfifo_out(&buffer->rec, buffer->rbuf, buffer_capacity(buffer));
+		if (len > seg) {
+			printk(KERN_NOTICE "shofer:record truncated (%u > %zu)\n",
+				len, seg);
+			len = seg;
+		}
+
+		if (copy_to_iter(buffer->rbuf, len, to) != len)
+			return retval ? retval : -EFAULT;
+		iov_iter_advance(to, seg - len); /* rest of segment unused */
+
+		retval += len;
+	}
+
+	return retval;
+}
+
+/* Record mode: store each segment of iterator as one record */
+static ssize_t records_from_iter(struct buffer *buffer, struct iov_iter *from)
+{
+	ssize_t retval = 0;
+	size_t seg;
+
+	while (iov_iter_count(from)) {
+		seg = iov_iter_single_seg_count(from);
+		if (seg == 0 || seg > buffer_capacity(buffer))
+			return retval ? retval : -EMSGSIZE;
+		if (kfifo_avail(&buffer->rec) < seg)
+			break; /* rest doesn't fit; return what is written */
+
+		if (copy_from_iter(buffer->wbuf, seg, from) != seg)
+			return retval ? retval : -EFAULT;
+		kfifo_in(&buffer->rec, buffer->wbuf, seg);
+
+		retval += seg;
+	}
+
+	return retval;
+}
+
+/* Free space in buffer: in record mode largest message that would fit */
+static unsigned int buffer_avail(struct buffer *buffer)
+{
+	if (record_mode)
+		return kfifo_avail(&buffer->rec);
+	else
+		return kfifo_avail(&buffer->fifo);
+}
+
 static void dump_buffer(struct buffer *b)
 {
 	char buf[BUFFER_SIZE];
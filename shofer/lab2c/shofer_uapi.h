@@ -0,0 +1,32 @@
+/*
+ * shofer_uapi.h -- definitions shared with user space programs
+ *
+ * Copyright (C) 2021 Leonardo Jelenkovic
+ *
+ * The source code in this file can be freely used, adapted,
+ * and redistributed in source or binary form.
+ * No warranty is attached.
+ *
+ */
+
+#pragma once
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Session mode (module parameter session_mode=1)
+ *
+ * Each file opened for reading is a session with its own buffer. File
+ * opened for writing is connected to a reader's session with
+ * SHOFER_IOC_PAIR; its writes then go into that session's buffer only.
+ * Many writers can be paired with the same reader. Write fails with
+ * ENOTCONN before pairing and with EPIPE after reader closed its file.
+ */
+
+#define SHOFER_IOC_MAGIC	'z'
+
+/* get session id of opened file */
+#define SHOFER_IOC_SESSION	_IOR(SHOFER_IOC_MAGIC, 1, __u32)
+/* connect writer's file with reader session given with *arg (its id) */
+#define SHOFER_IOC_PAIR		_IOW(SHOFER_IOC_MAGIC, 2, __u32)